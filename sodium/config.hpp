@@ -13,15 +13,19 @@
 #endif
 
 #if __WORDSIZE == 32
-#define SODIUM_STRONG_BITS 1
-#define SODIUM_STREAM_BITS  14
-#define SODIUM_NODE_BITS   14
-#define SODIUM_CONSERVE_MEMORY
+#if !defined(SODIUM_RANK_GAP)
+#define SODIUM_RANK_GAP    32
+#endif
 #elif __WORDSIZE == 64
-#define SODIUM_STRONG_BITS 1
-#define SODIUM_STREAM_BITS  31
-#define SODIUM_NODE_BITS   31
-#define SODIUM_CONSERVE_MEMORY
+#if !defined(SODIUM_RANK_GAP)
+#define SODIUM_RANK_GAP    1024
+#endif
+#endif
+
+// How far apart node::link() spaces the ranks of newly linked nodes. Links into
+// the gaps don't need to re-rank anything downstream.
+#if !defined(SODIUM_RANK_GAP)
+#define SODIUM_RANK_GAP    32
 #endif
 
 #endif
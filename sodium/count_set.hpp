@@ -8,173 +8,212 @@
 #define _SODIUM_COUNT_SET_HPP_
 
 #include <sodium/config.hpp>
+#include <sodium/lock_pool.hpp>
+#if !defined(SODIUM_SINGLE_THREADED)
+#include <atomic>
+#endif
+#include <stdint.h>
 #include <limits.h>
 #include <assert.h>
 
+#if !defined(SODIUM_STRONG_BITS)
+#if UINTPTR_MAX > 0xffffffffu
+#define SODIUM_STRONG_BITS 20
+#define SODIUM_STREAM_BITS 21
+#define SODIUM_NODE_BITS   21
+#else
+#define SODIUM_STRONG_BITS 10
+#define SODIUM_STREAM_BITS 10
+#define SODIUM_NODE_BITS   10
+#endif
+#endif
+
 namespace sodium {
     namespace impl {
 
+        /*!
+         * The counts once any of them has outgrown its bits. Only changed with
+         * the count_set's lock_pool stripe held.
+         */
         struct large_count_set {
             large_count_set(
                     unsigned strong_count_,
                     unsigned stream_count_,
-                    unsigned node_count_
+                    unsigned node_count_,
+                    bool closed_
                 ) : strong_count(strong_count_),
                     stream_count(stream_count_),
-                    node_count(node_count_)
+                    node_count(node_count_),
+                    closed(closed_)
             {
             }
             unsigned strong_count;
             unsigned stream_count;
             unsigned node_count;
+            bool closed;
         };
 
-#if defined(SODIUM_CONSERVE_MEMORY)
-        struct small_count_set {
-            unsigned is_small:1;
-            unsigned strong_count:SODIUM_STRONG_BITS;
-            unsigned stream_count:SODIUM_STREAM_BITS;
-            unsigned node_count:SODIUM_NODE_BITS;
-        };
-        
-        #define SODIUM_STRONG_MAX ((1u << SODIUM_STRONG_BITS) - 1u)
-        #define SODIUM_STREAM_MAX  ((1u << SODIUM_STREAM_BITS) - 1u)
-        #define SODIUM_NODE_MAX   ((1u << SODIUM_NODE_BITS) - 1u)
-
-        union count_set_impl {
-            small_count_set small;
-            large_count_set* large;
-        };
-#endif
+        #define SODIUM_IMPL_COUNT_LARGE     ((uintptr_t)1)
+        #define SODIUM_IMPL_COUNT_CLOSED    ((uintptr_t)2)
+        #define SODIUM_IMPL_STRONG_SHIFT    2
+        #define SODIUM_IMPL_STREAM_SHIFT    (SODIUM_IMPL_STRONG_SHIFT + SODIUM_STRONG_BITS)
+        #define SODIUM_IMPL_NODE_SHIFT      (SODIUM_IMPL_STREAM_SHIFT + SODIUM_STREAM_BITS)
 
         /*!
-         * Three counters implemented so as to fit into one machine word in the common case.
+         * Three counters in one machine word, changed with compare-and-swap so taking
+         * and dropping references doesn't lock anything. A count that outgrows its
+         * bits moves all three to a large_count_set on the heap, and from then on
+         * they're changed under a lock.
+         *
+         * Dropping a reference tells the caller what to do about it. The first time
+         * the set stops being active, the caller is told to clean up, and is given a
+         * strong reference to hold while it does; dropping that reference is an
+         * ordinary dec_strong(). When nothing is left, the caller is told to destroy
+         * the owner. Exactly one caller is told each thing.
          */
         class count_set {
-            private:
-                // disable copy constructor and assignment
-                count_set(const count_set&)
-#if !defined(SODIUM_CONSERVE_MEMORY)
-                : impl(0,0,0)
-#endif
-                {}
-                count_set& operator = (const count_set&) { return *this; }
-#if defined(SODIUM_CONSERVE_MEMORY)
-                count_set_impl impl;
-                void to_large() {
-                    impl.large = new large_count_set(impl.small.strong_count, impl.small.stream_count, impl.small.node_count);
-                    assert(!impl.small.is_small);
-                }
-#else
-                large_count_set impl;
-#endif
             public:
-#if defined(SODIUM_CONSERVE_MEMORY)
-                count_set() {
-                    impl.small.strong_count = 0;
-                    impl.small.stream_count = 0;
-                    impl.small.node_count = 0;
-                    impl.small.is_small = 1;
-                }
-#else
-                count_set() : impl(0,0,0) {}
-#endif
+                count_set(const count_set&) = delete;
+                count_set& operator = (const count_set&) = delete;
+
+                enum transition {
+                    none,
+                    clean_up,
+                    destroy
+                };
+
+                count_set() : word(0) {}
                 ~count_set() {
-#if defined(SODIUM_CONSERVE_MEMORY)
-                    if (!impl.small.is_small)
-                        delete impl.large;
-#endif
+                    uintptr_t w = load();
+                    if (w & SODIUM_IMPL_COUNT_LARGE)
+                        delete large_of(w);
                 }
-                bool active() const {
-#if defined(SODIUM_CONSERVE_MEMORY)
-                    return impl.small.is_small ? impl.small.strong_count || (impl.small.node_count && impl.small.stream_count) :
-                                               impl.large->strong_count || (impl.large->node_count && impl.large->stream_count);
+
+                void inc_strong()         { inc(SODIUM_IMPL_STRONG_SHIFT, SODIUM_STRONG_BITS, &large_count_set::strong_count); }
+                transition dec_strong()   { return dec(SODIUM_IMPL_STRONG_SHIFT, SODIUM_STRONG_BITS, &large_count_set::strong_count); }
+                void inc_stream()         { inc(SODIUM_IMPL_STREAM_SHIFT, SODIUM_STREAM_BITS, &large_count_set::stream_count); }
+                transition dec_stream()   { return dec(SODIUM_IMPL_STREAM_SHIFT, SODIUM_STREAM_BITS, &large_count_set::stream_count); }
+                void inc_node()           { inc(SODIUM_IMPL_NODE_SHIFT, SODIUM_NODE_BITS, &large_count_set::node_count); }
+                transition dec_node()     { return dec(SODIUM_IMPL_NODE_SHIFT, SODIUM_NODE_BITS, &large_count_set::node_count); }
+
+                // These are snapshots, which may already be out of date on return.
+                unsigned strong_count() const { return get(SODIUM_IMPL_STRONG_SHIFT, SODIUM_STRONG_BITS, &large_count_set::strong_count); }
+                unsigned stream_count() const { return get(SODIUM_IMPL_STREAM_SHIFT, SODIUM_STREAM_BITS, &large_count_set::stream_count); }
+                unsigned node_count() const   { return get(SODIUM_IMPL_NODE_SHIFT, SODIUM_NODE_BITS, &large_count_set::node_count); }
+                bool is_large() const { return (load() & SODIUM_IMPL_COUNT_LARGE) != 0; }
+
+            private:
+                typedef unsigned large_count_set::*field;
+
+#if defined(SODIUM_SINGLE_THREADED)
+                uintptr_t word;
+                uintptr_t load() const { return word; }
+                bool replace(uintptr_t& expected, uintptr_t desired) { word = desired; return true; }
 #else
-                    return impl.strong_count || (impl.node_count && impl.stream_count);
-#endif
+                std::atomic<uintptr_t> word;
+                uintptr_t load() const { return word.load(std::memory_order_acquire); }
+                /*!
+                 * Releases so that whoever destroys the owner sees everything done
+                 * through this reference, and acquires so the destroyer sees the rest.
+                 */
+                bool replace(uintptr_t& expected, uintptr_t desired) {
+                    return word.compare_exchange_weak(expected, desired, std::memory_order_acq_rel,
+                                                      std::memory_order_acquire);
                 }
-                bool alive() const {
-#if defined(SODIUM_CONSERVE_MEMORY)
-                    return impl.small.is_small ? impl.small.strong_count || impl.small.node_count || impl.small.stream_count
-                                         : impl.large->strong_count || impl.large->node_count || impl.large->stream_count;
-#else
-                    return impl.strong_count || impl.node_count || impl.stream_count;
 #endif
+
+                static uintptr_t field_of(uintptr_t w, int shift, int bits) {
+                    return (w >> shift) & (((uintptr_t)1 << bits) - 1);
                 }
-                void inc_strong() {
-#if defined(SODIUM_CONSERVE_MEMORY)
-                    if (impl.small.is_small) {
-                        if (impl.small.strong_count == SODIUM_STRONG_MAX)
-                            to_large();
-                        else {
-                            impl.small.strong_count++;
-                            return;
-                        }
-                    }
-                    impl.large->strong_count++;
-#else
-                    impl.strong_count++;
-#endif
+                static large_count_set* large_of(uintptr_t w) {
+                    return reinterpret_cast<large_count_set*>(w & ~SODIUM_IMPL_COUNT_LARGE);
                 }
-                void dec_strong() {
-#if defined(SODIUM_CONSERVE_MEMORY)
-                    if (impl.small.is_small)
-                        impl.small.strong_count--;
-                    else
-                        impl.large->strong_count--;
-#else
-                    impl.strong_count--;
-#endif
+                static bool active(unsigned strong, unsigned stream, unsigned node) {
+                    return strong || (node && stream);
                 }
-                void inc_stream() {
-#if defined(SODIUM_CONSERVE_MEMORY)
-                    if (impl.small.is_small) {
-                        if (impl.small.stream_count == SODIUM_STREAM_MAX)
-                            to_large();
-                        else {
-                            impl.small.stream_count++;
-                            return;
-                        }
-                    }
-                    impl.large->stream_count++;
-#else
-                    impl.stream_count++;
-#endif
+                static bool active(uintptr_t w) {
+                    return active(field_of(w, SODIUM_IMPL_STRONG_SHIFT, SODIUM_STRONG_BITS),
+                                  field_of(w, SODIUM_IMPL_STREAM_SHIFT, SODIUM_STREAM_BITS),
+                                  field_of(w, SODIUM_IMPL_NODE_SHIFT, SODIUM_NODE_BITS));
                 }
-                void dec_stream() {
-#if defined(SODIUM_CONSERVE_MEMORY)
-                    if (impl.small.is_small)
-                        impl.small.stream_count--;
-                    else
-                        impl.large->stream_count--;
-#else
-                    impl.stream_count--;
-#endif
+                static bool alive(uintptr_t w) {
+                    return (w >> SODIUM_IMPL_STRONG_SHIFT) != 0;
                 }
-                void inc_node() {
-#if defined(SODIUM_CONSERVE_MEMORY)
-                    if (impl.small.is_small) {
-                        if (impl.small.node_count == SODIUM_NODE_MAX)
-                            to_large();
-                        else {
-                            impl.small.node_count++;
+
+                unsigned get(int shift, int bits, field f) const {
+                    uintptr_t w = load();
+                    if (w & SODIUM_IMPL_COUNT_LARGE) {
+                        spin_lock* l = spin_get_and_lock(const_cast<count_set*>(this));
+                        unsigned c = large_of(w)->*f;
+                        l->unlock();
+                        return c;
+                    }
+                    return (unsigned)field_of(w, shift, bits);
+                }
+
+                void inc(int shift, int bits, field f) {
+                    uintptr_t w = load();
+                    while (!(w & SODIUM_IMPL_COUNT_LARGE)) {
+                        if (field_of(w, shift, bits) == ((uintptr_t)1 << bits) - 1) {
+                            if (to_large(w))
+                                break;
+                        }
+                        else if (replace(w, w + ((uintptr_t)1 << shift)))
                             return;
+                    }
+                    spin_lock* l = spin_get_and_lock(this);
+                    large_of(load())->*f += 1;
+                    l->unlock();
+                }
+
+                transition dec(int shift, int bits, field f) {
+                    uintptr_t w = load();
+                    while (!(w & SODIUM_IMPL_COUNT_LARGE)) {
+                        assert(field_of(w, shift, bits) != 0);
+                        uintptr_t n = w - ((uintptr_t)1 << shift);
+                        transition t = none;
+                        if (!(n & SODIUM_IMPL_COUNT_CLOSED) && !active(n)) {
+                            // The caller's strong reference for cleaning up can't overflow,
+                            // since the strong count is zero.
+                            n = (n | SODIUM_IMPL_COUNT_CLOSED) + ((uintptr_t)1 << SODIUM_IMPL_STRONG_SHIFT);
+                            t = clean_up;
                         }
+                        else if (!alive(n))
+                            t = destroy;
+                        if (replace(w, n))
+                            return t;
                     }
-                    impl.large->node_count++;
-#else
-                    impl.node_count++;
-#endif
+                    spin_lock* l = spin_get_and_lock(this);
+                    large_count_set* lc = large_of(load());
+                    assert(lc->*f != 0);
+                    lc->*f -= 1;
+                    transition t = none;
+                    if (!lc->closed && !active(lc->strong_count, lc->stream_count, lc->node_count)) {
+                        lc->closed = true;
+                        lc->strong_count++;
+                        t = clean_up;
+                    }
+                    else if (!lc->strong_count && !lc->stream_count && !lc->node_count)
+                        t = destroy;
+                    l->unlock();
+                    return t;
                 }
-                void dec_node() {
-#if defined(SODIUM_CONSERVE_MEMORY)
-                    if (impl.small.is_small)
-                        impl.small.node_count--;
-                    else
-                        impl.large->node_count--;
-#else
-                    impl.node_count--;
-#endif
+
+                /*!
+                 * Move the counts in w to the heap. Returns false if the word had
+                 * changed, in which case w is updated.
+                 */
+                bool to_large(uintptr_t& w) {
+                    large_count_set* lc = new large_count_set(
+                        (unsigned)field_of(w, SODIUM_IMPL_STRONG_SHIFT, SODIUM_STRONG_BITS),
+                        (unsigned)field_of(w, SODIUM_IMPL_STREAM_SHIFT, SODIUM_STREAM_BITS),
+                        (unsigned)field_of(w, SODIUM_IMPL_NODE_SHIFT, SODIUM_NODE_BITS),
+                        (w & SODIUM_IMPL_COUNT_CLOSED) != 0);
+                    assert(((uintptr_t)lc & SODIUM_IMPL_COUNT_LARGE) == 0);
+                    if (replace(w, (uintptr_t)lc | SODIUM_IMPL_COUNT_LARGE))
+                        return true;
+                    delete lc;
+                    return false;
                 }
         };
     }
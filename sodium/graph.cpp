@@ -0,0 +1,173 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#include <sodium/graph.hpp>
+#include <deque>
+#include <sstream>
+#include <unordered_map>
+
+namespace sodium {
+
+    namespace {
+        /*!
+         * The node a stream gets its values from, following fused stages back to
+         * their input.
+         */
+        impl::node* node_of(impl::listen_impl_func<impl::H_STREAM>* li)
+        {
+            while (li != NULL && li->func != NULL) {
+                if (li->owner != NULL)
+                    return li->owner;
+                li = li->input;
+            }
+            return NULL;
+        }
+
+        struct walker {
+            graph_info info;
+            std::unordered_map<const impl::node*, size_t> index;
+            std::deque<const impl::node*> todo;
+
+            size_t visit(const impl::node* n)
+            {
+                std::unordered_map<const impl::node*, size_t>::iterator it = index.find(n);
+                if (it != index.end())
+                    return it->second;
+                size_t ix = info.nodes.size();
+                index[n] = ix;
+                info.nodes.push_back(graph_info::node_info());
+                todo.push_back(n);
+                return ix;
+            }
+
+            void describe(const impl::node* n, size_t ix)
+            {
+                graph_info::node_info& ni = info.nodes[ix];
+                ni.id = n;
+                ni.rank = n->rank;
+                ni.fan_in = n->sources.size();
+                ni.firings = n->firings.size();
+                if (n->listen_impl) {
+                    ni.strong_count = n->listen_impl->counts.strong_count();
+                    ni.stream_count = n->listen_impl->counts.stream_count();
+                    ni.node_count = n->listen_impl->counts.node_count();
+                }
+            }
+
+            void walk()
+            {
+                while (!todo.empty()) {
+                    const impl::node* n = todo.front();
+                    todo.pop_front();
+                    size_t ix = index[n];
+                    describe(n, ix);
+                    for (std::vector<impl::node::target>::const_iterator it = n->targets.begin(); it != n->targets.end(); ++it) {
+                        if (it->handle == impl::node::no_handle)
+                            continue;
+                        info.nodes[ix].fan_out++;
+                        if (it->n) {
+                            size_t to = visit(it->n.get());
+                            info.edges.push_back(std::make_pair(ix, to));
+                        }
+                    }
+                    // Edges into this node are added when its sources are walked.
+                    for (std::vector<impl::node::source>::const_iterator it = n->sources.begin(); it != n->sources.end(); ++it)
+                        visit(it->from);
+                }
+            }
+        };
+
+        void write_json_string(std::ostream& os, const std::string& s)
+        {
+            os << '"';
+            for (std::string::const_iterator it = s.begin(); it != s.end(); ++it) {
+                if (*it == '"' || *it == '\\')
+                    os << '\\';
+                os << *it;
+            }
+            os << '"';
+        }
+    }
+
+    graph_info graph_inspector::inspect() const
+    {
+        walker w;
+        for (std::vector<impl::stream_>::const_iterator it = roots.begin(); it != roots.end(); ++it) {
+            // Links don't cross partitions, so everything reached from a root is
+            // guarded by the lock of the root's partition.
+            transaction trans(it->part());
+            impl::node* n = node_of(it->p_listen_impl.get());
+            if (n != NULL) {
+                size_t ix = w.visit(n);
+                w.walk();
+                w.info.nodes[ix].root = true;
+            }
+            trans.close();
+        }
+        return w.info;
+    }
+
+    std::string graph_info::to_dot() const
+    {
+        std::ostringstream os;
+        os << "digraph sodium {\n";
+        for (size_t i = 0; i < nodes.size(); i++) {
+            const node_info& ni = nodes[i];
+            os << "    n" << i << " [label=\"";
+            if (ni.rank == SODIUM_IMPL_RANK_T_MAX)
+                os << "listener";
+            else
+                os << "rank " << ni.rank;
+            os << "\\nin " << ni.fan_in << " out " << ni.fan_out;
+            if (ni.firings != 0)
+                os << "\\nfirings " << ni.firings;
+            os << "\"";
+            if (ni.root)
+                os << " shape=box";
+            os << "];\n";
+        }
+        for (std::vector<std::pair<size_t, size_t> >::const_iterator it = edges.begin(); it != edges.end(); ++it)
+            os << "    n" << it->first << " -> n" << it->second << ";\n";
+        os << "}\n";
+        return os.str();
+    }
+
+    std::string graph_info::to_json() const
+    {
+        std::ostringstream os;
+        os << "{\"nodes\":[";
+        for (size_t i = 0; i < nodes.size(); i++) {
+            const node_info& ni = nodes[i];
+            std::ostringstream id;
+            id << ni.id;
+            if (i != 0)
+                os << ',';
+            os << "{\"index\":" << i << ",\"id\":";
+            write_json_string(os, id.str());
+            os << ",\"rank\":";
+            if (ni.rank == SODIUM_IMPL_RANK_T_MAX)
+                os << "null";
+            else
+                os << ni.rank;
+            os << ",\"fan_in\":" << ni.fan_in
+               << ",\"fan_out\":" << ni.fan_out
+               << ",\"firings\":" << ni.firings
+               << ",\"strong_count\":" << ni.strong_count
+               << ",\"stream_count\":" << ni.stream_count
+               << ",\"node_count\":" << ni.node_count
+               << ",\"root\":" << (ni.root ? "true" : "false")
+               << '}';
+        }
+        os << "],\"edges\":[";
+        for (size_t i = 0; i < edges.size(); i++) {
+            if (i != 0)
+                os << ',';
+            os << '[' << edges[i].first << ',' << edges[i].second << ']';
+        }
+        os << "]}";
+        return os.str();
+    }
+}
@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_GRAPH_HPP_
+#define _SODIUM_GRAPH_HPP_
+
+#include <sodium/sodium.hpp>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace sodium {
+
+    /*!
+     * A snapshot of part of the node graph, for finding out what a program has
+     * actually built: unexpectedly large fan-outs, subgraphs that should have gone
+     * away, and so on.
+     */
+    struct graph_info {
+        struct node_info {
+            node_info()
+                : id(NULL), rank(0), fan_in(0), fan_out(0), firings(0),
+                  strong_count(0), stream_count(0), node_count(0), root(false) {}
+
+            const void* id;       // Address of the node, to tie up separate snapshots
+            impl::rank_t rank;    // SODIUM_IMPL_RANK_T_MAX for listeners
+            size_t fan_in;        // Nodes linked to this one
+            size_t fan_out;       // Live links from this one, including ranking-only ones
+            size_t firings;       // Values sent to it in the current transaction
+            // Reference counts of the node's stream, or zero if it has none
+            unsigned strong_count;
+            unsigned stream_count;
+            unsigned node_count;
+            bool root;            // One of the streams or cells the walk started from
+        };
+
+        std::vector<node_info> nodes;
+        std::vector<std::pair<size_t, size_t> > edges;  // Indices into nodes, from -> to
+
+        /*!
+         * The graph in Graphviz format.
+         */
+        std::string to_dot() const;
+
+        /*!
+         * The graph as a JSON object with "nodes" and "edges" arrays. Listeners have
+         * a null rank.
+         */
+        std::string to_json() const;
+    };
+
+    /*!
+     * Walks the graph that the given streams and cells are part of, that is,
+     * everything connected to them in either direction.
+     *
+     * Each root is walked in a transaction in its own partition, so call inspect()
+     * with no transaction open, or from one in the graph's partition.
+     */
+    class graph_inspector {
+        public:
+            template <typename A>
+            graph_inspector& add(const stream<A>& s) {
+                roots.push_back(s);
+                return *this;
+            }
+
+            template <typename A>
+            graph_inspector& add(const cell<A>& c) {
+                roots.push_back(impl::underlying_stream(c));
+                return *this;
+            }
+
+            graph_info inspect() const;
+
+        private:
+            std::vector<impl::stream_> roots;
+    };
+}
+
+#endif
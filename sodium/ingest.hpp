@@ -0,0 +1,140 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_INGEST_HPP_
+#define _SODIUM_INGEST_HPP_
+
+#include <sodium/sodium.hpp>
+#include <sodium/mpsc_queue.hpp>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+namespace sodium {
+    namespace impl {
+
+        template <typename A>
+        struct ingest_state {
+            struct item : mpsc_node {
+                item(const A& value_) : value(value_) {}
+                item(A&& value_) : value(std::move(value_)) {}
+                A value;
+            };
+
+            ingest_state(const stream_sink<A>& snk_, size_t group_)
+                : snk(snk_), part(current_partition()), group(group_ > 0 ? group_ : 1),
+                  pending(0), draining(false)
+            {
+            }
+            ~ingest_state()
+            {
+                while (mpsc_node* n = q.pop())
+                    delete static_cast<item*>(n);
+            }
+
+            stream_sink<A> snk;
+            partition* part;
+            size_t group;
+            mpsc_queue q;
+            std::atomic<size_t> pending;  // Pushed but not yet sent
+            std::atomic<bool> draining;
+
+            void push(item* it)
+            {
+                q.push(it);
+                pending++;
+                // Whichever thread gets the draining flag sends everything that's
+                // queued. A thread that finds the flag taken can leave, because the
+                // drainer checks 'pending' again after it lets the flag go.
+                while (pending.load() != 0 && !draining.exchange(true)) {
+                    part->mx.lock();
+                    size_t todo = pending.load();
+                    size_t done = 0;
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                    try {
+#endif
+                        while (done < todo) {
+                            transaction trans(part);
+                            size_t end = std::min(todo, done + group);
+                            while (done < end) {
+                                mpsc_node* n = q.pop();
+                                if (n == NULL) {
+                                    // A producer that was ahead of us is still linking its
+                                    // item in.
+                                    std::this_thread::yield();
+                                    continue;
+                                }
+                                std::unique_ptr<item> it2(static_cast<item*>(n));
+                                done++;
+                                snk.send(std::move(it2->value));
+                            }
+                            trans.close();
+                        }
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                    }
+                    catch (...) {
+                        pending -= done;
+                        part->mx.unlock();
+                        draining = false;
+                        throw;
+                    }
+#endif
+                    pending -= done;
+                    part->mx.unlock();
+                    draining = false;
+                }
+            }
+        };
+    }
+
+    /*!
+     * A stream sink for feeding values in from many threads at once. send() queues the
+     * value without taking any locks, and one of the sending threads then commits
+     * everything that's queued while holding the partition's lock just once, instead of
+     * every send() contending for it.
+     *
+     * Values are sent in the order they were queued. With a group size of 1 (the
+     * default) each value gets its own transaction, exactly as with stream_sink. A
+     * larger group size puts up to that many values in each transaction, where they
+     * are combined as for stream_sink.
+     *
+     * send() may return before its value has been processed, if another thread is
+     * already sending. As with stream_sink, it must not be called inside a Sodium
+     * callback.
+     */
+    template <typename A>
+    class ingest_sink : public stream<A>
+    {
+        private:
+            std::shared_ptr<impl::ingest_state<A>> state;
+
+        public:
+            ingest_sink(size_t group = 1)
+            {
+                stream_sink<A> snk;
+                state = std::shared_ptr<impl::ingest_state<A>>(new impl::ingest_state<A>(snk, group));
+                *static_cast<stream<A>*>(this) = snk;
+            }
+
+            ingest_sink(const std::function<A(const A&, const A&)>& f, size_t group = 1)
+            {
+                stream_sink<A> snk(f);
+                state = std::shared_ptr<impl::ingest_state<A>>(new impl::ingest_state<A>(snk, group));
+                *static_cast<stream<A>*>(this) = snk;
+            }
+
+            void send(const A& a) const {
+                state->push(new typename impl::ingest_state<A>::item(a));
+            }
+
+            void send(A&& a) const {
+                state->push(new typename impl::ingest_state<A>::item(std::move(a)));
+            }
+    };
+}
+
+#endif
@@ -5,10 +5,38 @@
  * C++ implementation courtesy of International Telematics Ltd.
  */
 #include <sodium/light_ptr.hpp>
-#include <sodium/lock_pool.hpp>
 
 namespace sodium {
-#define SODIUM_DEFINE_LIGHTPTR(Name, GET_AND_LOCK, UNLOCK) \
+    namespace {
+        inline void atomic_add_ref(impl::count* c)
+        {
+            // Taking a reference needs no ordering: whoever copies from it already has one.
+            c->c.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /*!
+         * Returns true if that was the last reference. The value's last uses on other
+         * threads happen before it's deleted.
+         */
+        inline bool atomic_release(impl::count* c)
+        {
+            return c->c.fetch_sub(1, std::memory_order_acq_rel) == 1;
+        }
+
+        inline void plain_add_ref(impl::count* c)
+        {
+            c->c.store(c->c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        inline bool plain_release(impl::count* c)
+        {
+            int n = c->c.load(std::memory_order_relaxed) - 1;
+            c->c.store(n, std::memory_order_relaxed);
+            return n == 0;
+        }
+    }
+
+#define SODIUM_DEFINE_LIGHTPTR(Name, ADD_REF, RELEASE) \
     Name::Name() \
         : value(nullptr), count(nullptr) \
     { \
@@ -16,57 +44,44 @@ namespace sodium {
      \
     Name Name::DUMMY; \
      \
-    Name::Name(void* value_, impl::deleter del_) \
-        : value(value_), count(new impl::count(1, del_)) \
-    { \
-    } \
-     \
     Name::Name(const Name& other) \
         : value(other.value), count(other.count) \
     { \
-        GET_AND_LOCK; \
-        count->c++; \
-        UNLOCK; \
+        if (count != nullptr) \
+            ADD_REF(count); \
     } \
     \
     Name::~Name() { \
-        GET_AND_LOCK; \
-        if (count != nullptr && --count->c == 0) { \
-            UNLOCK; \
-            count->del(value); delete count; \
-        } \
-        else { \
-            UNLOCK; \
+        if (count != nullptr && RELEASE(count)) { \
+            count->del(count); \
         } \
     } \
      \
     Name& Name::operator = (const Name& other) { \
         if (count != other.count) { \
-            { \
-                GET_AND_LOCK; \
-                if (--count->c == 0) { \
-                    UNLOCK; \
-                    count->del(value); delete count; \
-                } \
-                else { \
-                    UNLOCK; \
-                } \
-            } \
+            /* Take the new reference first, in case other is only reachable */ \
+            /* through the old value. */ \
+            if (other.count != nullptr) \
+                ADD_REF(other.count); \
+            impl::count* old_count = count; \
             value = other.value; \
             count = other.count; \
-            { \
-                GET_AND_LOCK; \
-                count->c++; \
-                UNLOCK; \
+            if (old_count != nullptr && RELEASE(old_count)) { \
+                old_count->del(old_count); \
             } \
         } \
+        else \
+            value = other.value;  /* Both null, or both inline with no count */ \
         return *this; \
     }
 
-SODIUM_DEFINE_LIGHTPTR(light_ptr, impl::spin_lock* l = impl::spin_get_and_lock(this->value),
-                          l->unlock())
+#if defined(SODIUM_SINGLE_THREADED)
+SODIUM_DEFINE_LIGHTPTR(light_ptr, plain_add_ref, plain_release)
+#else
+SODIUM_DEFINE_LIGHTPTR(light_ptr, atomic_add_ref, atomic_release)
+#endif
 
-SODIUM_DEFINE_LIGHTPTR(unsafe_light_ptr,,)
+SODIUM_DEFINE_LIGHTPTR(unsafe_light_ptr, plain_add_ref, plain_release)
 
 };
 
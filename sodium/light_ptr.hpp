@@ -7,25 +7,60 @@
 #ifndef _SODIUM_LIGHTPTR_HPP_
 #define _SODIUM_LIGHTPTR_HPP_
 
+#include <atomic>
+#include <new>
+#include <type_traits>
 #include <utility>
 
 namespace sodium {
-    template <typename A>
-    void deleter(void* a0)
-    {
-        delete (A*)a0;
-    }
-
     namespace impl {
-        typedef void (*deleter)(void*);
+        struct count;
+        /*!
+         * Destroys the value and frees the block the count heads.
+         */
+        typedef void (*deleter)(count*);
         struct count {
             count(
                 int c_,
                 deleter del_
             ) : c(c_), del(del_) {}
-            int c;
+            std::atomic<int> c;  // Only changed atomically by the thread-safe variant
             deleter del;
         };
+
+        /*!
+         * A value that isn't stored inline, allocated in one block with its count.
+         */
+        template <typename A>
+        struct value_block : count {
+            template <typename B>
+            value_block(B&& b) : count(1, &value_block<A>::destroy), value(std::forward<B>(b)) {}
+            A value;
+
+            static void destroy(count* c)
+            {
+                delete static_cast<value_block<A>*>(c);
+            }
+        };
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 5
+        #define SODIUM_IMPL_TRIVIALLY_COPYABLE(A) (__has_trivial_copy(A) && __has_trivial_destructor(A))
+#else
+        #define SODIUM_IMPL_TRIVIALLY_COPYABLE(A) (std::is_trivially_copyable<A>::value)
+#endif
+
+        /*!
+         * Values that light_ptr keeps in place of the pointer: trivially copyable
+         * ones no bigger than a pointer. They have no count, and copying them is
+         * copying the bits, so creating and passing them on never allocates.
+         */
+        template <typename A>
+        struct stored_inline : std::integral_constant<bool,
+                sizeof(A) <= sizeof(void*) &&
+                std::alignment_of<A>::value <= std::alignment_of<void*>::value &&
+                SODIUM_IMPL_TRIVIALLY_COPYABLE(A)> {};
+
+        struct empty_tag {};  // For constructing a light_ptr to fill in
     };
 
     /*!
@@ -43,19 +78,39 @@ namespace sodium {
                 other.count = nullptr; \
             } \
             template <typename A> static inline name create(const A& a) { \
-                return name(new A(a), deleter<A>); \
+                return make<A>(a, impl::stored_inline<A>()); \
             } \
             template <typename A> static inline name create(A&& a) { \
-                return name(new A(std::move(a)), deleter<A>); \
+                return make<A>(std::move(a), impl::stored_inline<A>()); \
             } \
-            name(void* value, impl::deleter del); \
             ~name(); \
             name& operator = (const name& other); \
-            void* value; \
-            impl::count* count; \
+            union { \
+                void* value; \
+                unsigned char bytes[sizeof(void*)];  /* For a value stored inline */ \
+            }; \
+            impl::count* count;  /* NULL for a null or inline value */ \
          \
-            template <typename A> inline A* cast_ptr(A*) {return (A*)value;} \
-            template <typename A> inline const A* cast_ptr(A*) const {return (A*)value;} \
+            template <typename A> inline A* cast_ptr(A*) { \
+                return impl::stored_inline<A>::value ? reinterpret_cast<A*>(bytes) : (A*)value; \
+            } \
+            template <typename A> inline const A* cast_ptr(A*) const { \
+                return impl::stored_inline<A>::value ? reinterpret_cast<const A*>(bytes) : (const A*)value; \
+            } \
+        private: \
+            name(impl::empty_tag) : value(nullptr), count(nullptr) {} \
+            template <typename A, typename B> static inline name make(B&& b, std::true_type) { \
+                name r((impl::empty_tag())); \
+                new (r.bytes) A(std::forward<B>(b)); \
+                return r; \
+            } \
+            template <typename A, typename B> static inline name make(B&& b, std::false_type) { \
+                impl::value_block<A>* block = new impl::value_block<A>(std::forward<B>(b)); \
+                name r((impl::empty_tag())); \
+                r.value = &block->value; \
+                r.count = block; \
+                return r; \
+            } \
         };
 
     SODIUM_DECLARE_LIGHTPTR(light_ptr)        // Thread-safe variant
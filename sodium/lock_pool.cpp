@@ -4,8 +4,16 @@
  *
  * C++ implementation courtesy of International Telematics Ltd.
  */
- 
+
 #include <sodium/lock_pool.hpp>
+#if !defined(SODIUM_SINGLE_THREADED)
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#endif
 
 
 namespace sodium {
@@ -15,6 +23,77 @@ namespace sodium {
 #else
         spin_lock lock_pool[1<<SODIUM_IMPL_LOCK_POOL_BITS];
 #endif
+
+#if !defined(SODIUM_SINGLE_THREADED)
+        namespace {
+            const int spins = 100;
+            const int yields = 10;
+
+            /*!
+             * Where threads wait for a spin_lock once they've given up spinning.
+             * Locks share them by address, so a wake-up may be for another lock.
+             */
+            struct parking_spot {
+                std::mutex m;
+                std::condition_variable cv;
+            };
+            #define SODIUM_IMPL_PARKING_BITS 5
+#ifdef SUPPORTS_INIT_PRIORITY
+            parking_spot parking[1<<SODIUM_IMPL_PARKING_BITS] __attribute__ ((init_priority (101)));
+#else
+            parking_spot parking[1<<SODIUM_IMPL_PARKING_BITS];
+#endif
+
+            inline parking_spot& parking_for(void* addr)
+            {
+                return parking[(uint32_t)((uint32_t)
+                    (uintptr_t)(addr)
+                    * (uint32_t)2654435761U) >> (32 - SODIUM_IMPL_PARKING_BITS)];
+            }
+
+            inline void cpu_relax()
+            {
+#if defined(__x86_64__) || defined(__i386__)
+                _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+                __asm__ __volatile__("yield");
+#endif
+            }
+        }
+
+        void spin_lock::lock_slow()
+        {
+            for (int i = 0; i < spins + yields; i++) {
+                int unlocked = 0;
+                if (state.load(std::memory_order_relaxed) == 0 &&
+                        state.compare_exchange_weak(unlocked, 1, std::memory_order_acquire,
+                                                    std::memory_order_relaxed))
+                    return;
+                if (i < spins)
+                    cpu_relax();
+                else
+                    std::this_thread::yield();
+            }
+            // Mark the lock as having a waiter, so whoever unlocks it wakes us up.
+            // Having marked it, we must keep it marked when we get it, since there may
+            // be others waiting.
+            parking_spot& p = parking_for(this);
+            while (state.exchange(2, std::memory_order_acquire) != 0) {
+                std::unique_lock<std::mutex> lk(p.m);
+                while (state.load(std::memory_order_relaxed) == 2)
+                    p.cv.wait(lk);
+            }
+        }
+
+        void spin_lock::unpark()
+        {
+            parking_spot& p = parking_for(this);
+            // Taking the mutex means a thread that has just seen state == 2 is already
+            // waiting, so it can't miss this.
+            std::lock_guard<std::mutex> lk(p.m);
+            p.cv.notify_all();
+        }
+#endif
     }
 }
 
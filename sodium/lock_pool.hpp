@@ -8,32 +8,59 @@
 #define _SODIUM_LOCKPOOL_HPP_
 
 #include <sodium/config.hpp>
-#include <sodium/mutex.hpp>
+#if !defined(SODIUM_SINGLE_THREADED)
+#include <atomic>
+#endif
 #include <stdint.h>
 #include <limits.h>
 
 namespace sodium {
     namespace impl {
+        #define SODIUM_IMPL_CACHE_LINE 64
+
+#if defined(SODIUM_SINGLE_THREADED)
         struct spin_lock {
-            bool initialized;
-            sodium::mutex m;
-            spin_lock() : initialized(true) {
-            }
+            inline void lock() {}
+            inline void unlock() {}
+        };
+#else
+        /*!
+         * A lock that is only held for a few instructions at a time. Taking it
+         * spins for a while, then yields, and only then parks the thread, so an
+         * uncontended lock or unlock is one atomic operation.
+         *
+         * Its state is zero-initialized, so it works before its constructor has run
+         * during static initialization. Each one has a cache line to itself, so
+         * threads taking different locks don't slow each other down.
+         */
+        struct alignas(SODIUM_IMPL_CACHE_LINE) spin_lock {
+            constexpr spin_lock() : state(0) {}
             inline void lock() {
-                // Make sure nothing bad happens if this is called before the constructor.
-                // This can happen during static initialization if data structures that use
-                // this lock pool are declared statically.
-                if (initialized) m.lock();
+                int unlocked = 0;
+                if (!state.compare_exchange_weak(unlocked, 1, std::memory_order_acquire,
+                                                 std::memory_order_relaxed))
+                    lock_slow();
             }
             inline void unlock() {
-                if (initialized) m.unlock();
+                if (state.exchange(0, std::memory_order_release) == 2)
+                    unpark();
             }
+
+        private:
+            void lock_slow();
+            void unpark();
+            std::atomic<int> state;  // 0 = unlocked, 1 = locked, 2 = locked and a thread may be parked
         };
+#endif
+
+#if !defined(SODIUM_LOCK_POOL_BITS)
 #if defined(SODIUM_SINGLE_THREADED)
-		#define SODIUM_IMPL_LOCK_POOL_BITS 1
+        #define SODIUM_LOCK_POOL_BITS 1
 #else
-		#define SODIUM_IMPL_LOCK_POOL_BITS 7
+        #define SODIUM_LOCK_POOL_BITS 7
+#endif
 #endif
+        #define SODIUM_IMPL_LOCK_POOL_BITS SODIUM_LOCK_POOL_BITS
         extern spin_lock lock_pool[1<<SODIUM_IMPL_LOCK_POOL_BITS];
 
         // Use Knuth's integer hash function ("The Art of Computer Programming", section 6.4)
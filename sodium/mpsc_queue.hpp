@@ -0,0 +1,99 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_MPSC_QUEUE_HPP_
+#define _SODIUM_MPSC_QUEUE_HPP_
+
+#include <atomic>
+#include <stddef.h>
+
+namespace sodium {
+    namespace impl {
+
+        /*!
+         * A link in an mpsc_queue. Queued types derive from this.
+         */
+        struct mpsc_node {
+            mpsc_node() : next(NULL) {}
+            std::atomic<mpsc_node*> next;
+        };
+
+        /*!
+         * An intrusive multiple-producer single-consumer queue (Dmitry Vyukov's
+         * algorithm). push() is wait-free and may be called from any thread. pop() and
+         * empty() must only be called by one thread at a time.
+         *
+         * The queue doesn't own its nodes: the consumer takes ownership of each node
+         * that pop() returns.
+         */
+        class mpsc_queue {
+            private:
+                std::atomic<mpsc_node*> head;  // Most recently pushed
+                mpsc_node* tail;               // Next to pop
+                mpsc_node stub;
+
+                // Disallow copying
+                mpsc_queue(const mpsc_queue&) {}
+                mpsc_queue& operator = (const mpsc_queue&) { return *this; }
+
+            public:
+                mpsc_queue() : head(&stub), tail(&stub) {}
+
+                /*!
+                 * Add a node.
+                 */
+                void push(mpsc_node* n) {
+                    n->next.store(NULL, std::memory_order_relaxed);
+                    mpsc_node* prev = head.exchange(n, std::memory_order_acq_rel);
+                    prev->next.store(n, std::memory_order_release);
+                }
+
+                /*!
+                 * Remove the oldest node, or return NULL if there's nothing that can be
+                 * popped yet. NULL is also returned while a push() is half way through
+                 * linking its node in; that producer will have returned from push() once
+                 * its node can be popped.
+                 */
+                mpsc_node* pop() {
+                    mpsc_node* t = tail;
+                    mpsc_node* next = t->next.load(std::memory_order_acquire);
+                    if (t == &stub) {
+                        if (next == NULL)
+                            return NULL;
+                        tail = next;
+                        t = next;
+                        next = next->next.load(std::memory_order_acquire);
+                    }
+                    if (next != NULL) {
+                        tail = next;
+                        return t;
+                    }
+                    if (t != head.load(std::memory_order_acquire))
+                        return NULL;
+                    push(&stub);
+                    next = t->next.load(std::memory_order_acquire);
+                    if (next != NULL) {
+                        tail = next;
+                        return t;
+                    }
+                    return NULL;
+                }
+
+                /*!
+                 * True if pop() would return NULL. A push() may be in progress.
+                 */
+                bool empty() const {
+                    mpsc_node* t = tail;
+                    mpsc_node* next = t->next.load(std::memory_order_acquire);
+                    if (t == &stub)
+                        return next == NULL;
+                    return next == NULL && t != head.load(std::memory_order_acquire);
+                }
+        };
+    }
+}
+
+#endif
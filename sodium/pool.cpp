@@ -0,0 +1,282 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#include <sodium/pool.hpp>
+
+#if defined(SODIUM_POOL_ALLOCATOR)
+#include <sodium/lock_pool.hpp>
+#if !defined(SODIUM_SINGLE_THREADED)
+#include <atomic>
+#endif
+
+namespace sodium {
+    namespace impl {
+
+        namespace {
+            const size_t n_classes = SODIUM_IMPL_POOL_MAX_SIZE / SODIUM_IMPL_POOL_GRANULE;
+            const size_t chunk_size = 64 * 1024;
+            // Free blocks move between a thread and the shared pool in batches of this
+            // many, so the lock is taken once per batch.
+            const size_t batch_size = 64;
+
+            /*!
+             * Free blocks are kept as arrays of pointers rather than lists threaded
+             * through the blocks, so taking one doesn't have to read the block, which
+             * has usually gone cold since it was freed.
+             */
+            struct batch {
+                batch* next;
+                size_t n;
+                void* blocks[batch_size];
+            };
+
+            /*!
+             * Chunks are chained together so they're still reachable at exit, which
+             * keeps leak checkers quiet. Blocks start SODIUM_IMPL_POOL_GRANULE bytes in.
+             */
+            struct chunk_header {
+                chunk_header* next;
+            };
+
+            /*!
+             * Free blocks that aren't in any thread's cache. This is trivially
+             * constructed and destroyed, so it can be used during static initialization
+             * and destruction.
+             */
+            struct shared_pool {
+                batch* full[n_classes];
+#if defined(SODIUM_SINGLE_THREADED)
+                size_t n_full[n_classes];
+#else
+                std::atomic<size_t> n_full[n_classes];  // So threads can look without locking
+#endif
+                batch* spare;  // Empty batches to reuse
+                chunk_header* chunks;
+            };
+            shared_pool shared;
+
+            /*!
+             * A thread's free blocks of each size. New blocks of all sizes are cut one
+             * after another from the thread's current chunk, so objects that are made
+             * together, such as the parts of one stream, end up next to each other in
+             * memory.
+             */
+            struct thread_cache {
+                thread_cache() : next(NULL), end(NULL) {
+                    for (size_t c = 0; c < n_classes; c++)
+                        counts[c] = 0;
+                }
+                size_t counts[n_classes];
+                void* blocks[n_classes][batch_size * 2];
+                char* next;
+                char* end;
+            };
+
+#if defined(SODIUM_SINGLE_THREADED)
+            thread_cache* cache;
+
+            struct shared_lock {
+                shared_lock() {}
+            };
+#else
+            // Allocated on the heap to keep thread-local storage small.
+            thread_local thread_cache* cache;
+            thread_local bool retired;  // The thread is exiting and has given its cache back
+            // Constant-initialized, so it works during static initialization. It
+            // spins, then yields, then parks, so a preempted holder doesn't leave the
+            // others spinning.
+            spin_lock shared_spin;
+
+            struct shared_lock {
+                shared_lock() {
+                    shared_spin.lock();
+                }
+                ~shared_lock() {
+                    shared_spin.unlock();
+                }
+            };
+#endif
+
+            /*!
+             * Call with the shared lock held.
+             */
+            batch* new_batch()
+            {
+                batch* b = shared.spare;
+                if (b != NULL)
+                    shared.spare = b->next;
+                else
+                    b = new batch;
+                b->n = 0;
+                return b;
+            }
+
+            /*!
+             * Give the top n of the thread's free blocks of class c to the shared pool.
+             */
+            void give_back(thread_cache* tc, size_t c, size_t n)
+            {
+                shared_lock lock;
+                while (n != 0) {
+                    batch* b = new_batch();
+                    while (b->n < batch_size && n != 0) {
+                        b->blocks[b->n++] = tc->blocks[c][--tc->counts[c]];
+                        n--;
+                    }
+                    b->next = shared.full[c];
+                    shared.full[c] = b;
+                    shared.n_full[c]++;
+                }
+            }
+
+            /*!
+             * Move a batch of free blocks of class c into the thread's cache, if the
+             * shared pool has any.
+             */
+            bool take(thread_cache* tc, size_t c)
+            {
+                if (shared.n_full[c] == 0)
+                    return false;
+                shared_lock lock;
+                batch* b = shared.full[c];
+                if (b == NULL)
+                    return false;
+                shared.full[c] = b->next;
+                shared.n_full[c]--;
+                for (size_t i = 0; i < b->n; i++)
+                    tc->blocks[c][tc->counts[c]++] = b->blocks[i];
+                b->next = shared.spare;
+                shared.spare = b;
+                return true;
+            }
+
+#if !defined(SODIUM_SINGLE_THREADED)
+            /*!
+             * Gives the thread's free blocks back to the shared pool when it exits.
+             * What's left of its current chunk is abandoned.
+             */
+            struct cache_flusher {
+                ~cache_flusher() {
+                    if (cache != NULL) {
+                        for (size_t c = 0; c < n_classes; c++)
+                            give_back(cache, c, cache->counts[c]);
+                        delete cache;
+                        cache = NULL;
+                    }
+                    retired = true;
+                }
+            };
+            thread_local cache_flusher flusher;
+#endif
+
+            /*!
+             * Allocate for a thread that has gone past its cache_flusher.
+             */
+            void* retired_alloc(size_t c)
+            {
+                {
+                    shared_lock lock;
+                    batch* b = shared.full[c];
+                    if (b != NULL) {
+                        void* p = b->blocks[--b->n];
+                        if (b->n == 0) {
+                            shared.full[c] = b->next;
+                            shared.n_full[c]--;
+                            b->next = shared.spare;
+                            shared.spare = b;
+                        }
+                        return p;
+                    }
+                }
+                return ::operator new((c + 1) * SODIUM_IMPL_POOL_GRANULE);
+            }
+
+            void retired_free(void* p, size_t c)
+            {
+                shared_lock lock;
+                batch* b = shared.full[c];
+                if (b == NULL || b->n == batch_size) {
+                    b = new_batch();
+                    b->next = shared.full[c];
+                    shared.full[c] = b;
+                    shared.n_full[c]++;
+                }
+                b->blocks[b->n++] = p;
+            }
+
+            thread_cache* get_cache()
+            {
+#if !defined(SODIUM_SINGLE_THREADED)
+                if (retired)
+                    return NULL;
+                (void)&flusher;
+#endif
+                cache = new thread_cache;
+                return cache;
+            }
+
+            void* refill(size_t c)
+            {
+                thread_cache* tc = cache;
+                if (tc == NULL) {
+                    tc = get_cache();
+                    if (tc == NULL)
+                        return retired_alloc(c);
+                }
+                if (take(tc, c))
+                    return tc->blocks[c][--tc->counts[c]];
+                size_t block_size = (c + 1) * SODIUM_IMPL_POOL_GRANULE;
+                if (tc->next == NULL || tc->next + block_size > tc->end) {
+                    char* mem = static_cast<char*>(::operator new(chunk_size));
+                    chunk_header* h = reinterpret_cast<chunk_header*>(mem);
+                    {
+                        shared_lock lock;
+                        h->next = shared.chunks;
+                        shared.chunks = h;
+                    }
+                    tc->next = mem + SODIUM_IMPL_POOL_GRANULE;
+                    tc->end = mem + chunk_size;
+                }
+                void* p = tc->next;
+                tc->next += block_size;
+                return p;
+            }
+        }
+
+        void* pool_alloc(size_t size)
+        {
+            if (size > SODIUM_IMPL_POOL_MAX_SIZE)
+                return ::operator new(size);
+            size_t c = size == 0 ? 0 : (size - 1) / SODIUM_IMPL_POOL_GRANULE;
+            thread_cache* tc = cache;
+            if (tc == NULL || tc->counts[c] == 0)
+                return refill(c);
+            return tc->blocks[c][--tc->counts[c]];
+        }
+
+        void pool_free(void* p, size_t size)
+        {
+            if (size > SODIUM_IMPL_POOL_MAX_SIZE) {
+                ::operator delete(p);
+                return;
+            }
+            size_t c = size == 0 ? 0 : (size - 1) / SODIUM_IMPL_POOL_GRANULE;
+            thread_cache* tc = cache;
+            if (tc == NULL) {
+                tc = get_cache();
+                if (tc == NULL) {
+                    retired_free(p, c);
+                    return;
+                }
+            }
+            if (tc->counts[c] == batch_size * 2)
+                give_back(tc, c, batch_size);
+            tc->blocks[c][tc->counts[c]++] = p;
+        }
+    }
+}
+
+#endif
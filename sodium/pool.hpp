@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_POOL_HPP_
+#define _SODIUM_POOL_HPP_
+
+#include <sodium/config.hpp>
+#include <memory>
+#include <new>
+#include <utility>
+#include <stddef.h>
+
+namespace sodium {
+    namespace impl {
+
+#if defined(SODIUM_POOL_ALLOCATOR)
+        /*!
+         * Size-class pools for the small objects that make up a graph: nodes, stream
+         * state, holders and their shared_ptr control blocks. Sizes are rounded up
+         * to a multiple of SODIUM_IMPL_POOL_GRANULE, and each thread keeps its own
+         * free blocks, so allocating and freeing don't normally synchronize. Sizes
+         * over SODIUM_IMPL_POOL_MAX_SIZE go to operator new.
+         *
+         * Memory taken by the pools is reused but never given back.
+         */
+        #define SODIUM_IMPL_POOL_GRANULE  16
+        #define SODIUM_IMPL_POOL_MAX_SIZE 256
+
+        void* pool_alloc(size_t size);
+        /*!
+         * 'size' must be the size that was passed to pool_alloc().
+         */
+        void pool_free(void* p, size_t size);
+#else
+        inline void* pool_alloc(size_t size) { return ::operator new(size); }
+        inline void pool_free(void* p, size_t size) { ::operator delete(p); }
+#endif
+
+        /*!
+         * Base class for allocating an object from the pools with new and delete.
+         * Classes derived from it must not be deleted through a base pointer.
+         */
+        struct pooled {
+#if defined(SODIUM_POOL_ALLOCATOR)
+            static void* operator new(size_t size) { return pool_alloc(size); }
+            static void operator delete(void* p, size_t size) { pool_free(p, size); }
+#endif
+        };
+
+        /*!
+         * Allocator for std::allocate_shared(), which puts the object and its control
+         * block in a single pool allocation.
+         */
+        template <typename T>
+        struct pool_allocator {
+            typedef T value_type;
+            template <typename U> struct rebind { typedef pool_allocator<U> other; };
+
+            pool_allocator() {}
+            template <typename U>
+            pool_allocator(const pool_allocator<U>&) {}
+
+            T* allocate(size_t n) { return static_cast<T*>(pool_alloc(n * sizeof(T))); }
+            void deallocate(T* p, size_t n) { pool_free(p, n * sizeof(T)); }
+
+            template <typename U>
+            bool operator == (const pool_allocator<U>&) const { return true; }
+            template <typename U>
+            bool operator != (const pool_allocator<U>&) const { return false; }
+        };
+
+        template <typename T, typename... Args>
+        std::shared_ptr<T> new_shared(Args&&... args)
+        {
+            return std::allocate_shared<T>(pool_allocator<T>(), std::forward<Args>(args)...);
+        }
+    }
+}
+
+#endif
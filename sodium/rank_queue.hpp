@@ -0,0 +1,160 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_RANK_QUEUE_HPP_
+#define _SODIUM_RANK_QUEUE_HPP_
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <stddef.h>
+
+namespace sodium {
+    namespace impl {
+
+        /*!
+         * A bucket queue keyed on rank, giving entries out in (rank, id) order. Each
+         * rank that currently has entries owns a bucket, which is a FIFO. Buckets are
+         * kept in a pool and all vectors keep their capacity when they are emptied, so
+         * once the queue has warmed up, pushing and popping don't allocate.
+         *
+         * Only a handful of distinct ranks are pending at any one time, so the active
+         * ranks are kept in a sorted vector (highest first, so the lowest rank is at
+         * the back).
+         *
+         * Each bucket also keeps the total width of its entries, as given by Width,
+         * for entries that stand for more than one piece of work.
+         */
+        struct unit_width {
+            template <typename T>
+            size_t operator () (const T&) const { return 1; }
+        };
+
+        template <typename Rank, typename Id, typename T, typename Width = unit_width>
+        class rank_queue {
+            private:
+                struct item {
+                    item(Id id_, T&& value_) : id(id_), value(std::move(value_)) {}
+                    Id id;
+                    T value;
+                };
+                struct bucket {
+                    bucket() : rank(), head(0), width(0) {}
+                    Rank rank;
+                    std::vector<item> items;
+                    size_t head;
+                    size_t width;
+                };
+                struct by_rank_desc {
+                    by_rank_desc(const std::vector<bucket>& buckets_) : buckets(buckets_) {}
+                    const std::vector<bucket>& buckets;
+                    bool operator () (size_t b, const Rank& r) const { return buckets[b].rank > r; }
+                };
+                struct by_id {
+                    bool operator () (const item& it, const Id& id) const { return it.id < id; }
+                };
+
+                std::vector<bucket> buckets;
+                std::vector<size_t> free_buckets;
+                std::vector<size_t> active;
+                size_t count;
+
+                // Disallow copying
+                rank_queue(const rank_queue&) {}
+                rank_queue& operator = (const rank_queue&) { return *this; }
+
+                bucket& bucket_for(const Rank& rank) {
+                    std::vector<size_t>::iterator it =
+                        std::lower_bound(active.begin(), active.end(), rank, by_rank_desc(buckets));
+                    if (it != active.end() && buckets[*it].rank == rank)
+                        return buckets[*it];
+                    size_t b;
+                    if (free_buckets.empty()) {
+                        // Growing the pool moves the buckets, but not their items.
+                        b = buckets.size();
+                        buckets.push_back(bucket());
+                    }
+                    else {
+                        b = free_buckets.back();
+                        free_buckets.pop_back();
+                    }
+                    buckets[b].rank = rank;
+                    active.insert(it, b);
+                    return buckets[b];
+                }
+
+            public:
+                rank_queue() : count(0) {}
+
+                bool empty() const { return count == 0; }
+                size_t size() const { return count; }
+
+                /*!
+                 * Add an entry. Ids are normally handed out in increasing order, so this is
+                 * an append, but an older id will be placed in its proper FIFO position.
+                 */
+                void push(const Rank& rank, Id id, T value) {
+                    bucket& bu = bucket_for(rank);
+                    bu.width += Width()(value);
+                    if (bu.items.size() == bu.head || bu.items.back().id < id)
+                        bu.items.push_back(item(id, std::move(value)));
+                    else
+                        bu.items.insert(
+                            std::lower_bound(bu.items.begin() + bu.head, bu.items.end(), id, by_id()),
+                            item(id, std::move(value)));
+                    count++;
+                }
+
+                /*!
+                 * The rank of the lowest-ranked entry. The queue must not be empty.
+                 */
+                const Rank& top_rank() const { return buckets[active.back()].rank; }
+
+                /*!
+                 * The total width of the entries with the lowest rank. The queue must not
+                 * be empty.
+                 */
+                size_t top_width() const { return buckets[active.back()].width; }
+
+                /*!
+                 * Remove the lowest-ranked entry, giving its id and value. The queue must
+                 * not be empty.
+                 */
+                T pop(Id& id) {
+                    bucket& bu = buckets[active.back()];
+                    item& it = bu.items[bu.head];
+                    id = it.id;
+                    bu.width -= Width()(it.value);
+                    T value(std::move(it.value));
+                    if (++bu.head == bu.items.size()) {
+                        bu.items.clear();
+                        bu.head = 0;
+                        bu.width = 0;
+                        free_buckets.push_back(active.back());
+                        active.pop_back();
+                    }
+                    count--;
+                    return value;
+                }
+
+                /*!
+                 * Drop all entries, keeping the memory.
+                 */
+                void clear() {
+                    for (std::vector<size_t>::iterator it = active.begin(); it != active.end(); ++it) {
+                        buckets[*it].items.clear();
+                        buckets[*it].head = 0;
+                        buckets[*it].width = 0;
+                        free_buckets.push_back(*it);
+                    }
+                    active.clear();
+                    count = 0;
+                }
+        };
+    }
+}
+
+#endif
@@ -100,18 +100,17 @@ namespace sodium {
                     auto table(impl->table);
     
                     transaction trans1;
+                    partition* part = trans1.impl()->part;
     
                     auto it = table->table.insert(std::make_pair(sel, target));
-                    if (table->node->link(NULL, target))
-                        trans1.impl()->to_regen = true;
+                    size_t link_handle = table->node->link(NULL, target);
     
                     stream<A> out(stream<A>(std::get<0>(p)).unsafe_add_cleanup(
-                        new std::function<void()>([table, it] () {
-                            impl::transaction_ trans2;
-                            trans2.impl()->last([table, it] () {
-                                auto target2 = it->second;
+                        new std::function<void()>([table, it, part, link_handle] () {
+                            impl::transaction_ trans2(part);
+                            trans2.impl()->last([table, it, link_handle] () {
                                 table->table.erase(it);
-                                table->node->unlink_by_target(target2);
+                                table->node->unlink(link_handle);
                             });
                         })));
                     trans1.close();
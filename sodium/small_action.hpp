@@ -0,0 +1,144 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_SMALL_ACTION_HPP_
+#define _SODIUM_SMALL_ACTION_HPP_
+
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <stddef.h>
+
+namespace sodium {
+    namespace impl {
+
+        /*!
+         * A move-only void(Args...) callable for queued actions. Function objects up to
+         * inline_size bytes, which covers the closures the library queues (and a
+         * std::function), are stored inline, so queueing one doesn't allocate. Larger
+         * ones go on the heap.
+         */
+        template <typename... Args>
+        class basic_small_action {
+            public:
+                enum { inline_size = 6 * sizeof(void*) };
+
+                basic_small_action() : ops(NULL) {}
+
+                template <typename F,
+                          typename = typename std::enable_if<
+                              !std::is_same<typename std::decay<F>::type, basic_small_action>::value>::type>
+                basic_small_action(F&& f) : ops(NULL) {
+                    typedef typename std::decay<F>::type G;
+                    store<G>(std::forward<F>(f), fits<G>());
+                }
+
+                basic_small_action(basic_small_action&& other) noexcept : ops(other.ops) {
+                    if (ops != NULL) {
+                        ops->move(&other.buf, &buf);
+                        other.ops = NULL;
+                    }
+                }
+
+                basic_small_action& operator = (basic_small_action&& other) noexcept {
+                    if (this != &other) {
+                        reset();
+                        ops = other.ops;
+                        if (ops != NULL) {
+                            ops->move(&other.buf, &buf);
+                            other.ops = NULL;
+                        }
+                    }
+                    return *this;
+                }
+
+                ~basic_small_action() { reset(); }
+
+                void operator () (Args... args) { ops->call(&buf, args...); }
+                explicit operator bool () const { return ops != NULL; }
+
+                void reset() {
+                    if (ops != NULL) {
+                        ops->destroy(&buf);
+                        ops = NULL;
+                    }
+                }
+
+            private:
+                // Disallow copying
+                basic_small_action(const basic_small_action&) {}
+                basic_small_action& operator = (const basic_small_action&) { return *this; }
+
+                typedef typename std::aligned_storage<inline_size, sizeof(void*)>::type storage;
+
+                struct vtable {
+                    void (*call)(void* p, Args... args);
+                    void (*move)(void* from, void* to);  // Leaves 'from' destroyed
+                    void (*destroy)(void* p);
+                };
+
+                template <typename G>
+                struct fits : std::integral_constant<bool,
+                        sizeof(G) <= sizeof(storage) &&
+                        std::alignment_of<G>::value <= std::alignment_of<storage>::value &&
+                        std::is_nothrow_move_constructible<G>::value> {};
+
+                template <typename G>
+                struct local {
+                    static void call(void* p, Args... args) { (*static_cast<G*>(p))(args...); }
+                    static void move(void* from, void* to) {
+                        new (to) G(std::move(*static_cast<G*>(from)));
+                        static_cast<G*>(from)->~G();
+                    }
+                    static void destroy(void* p) { static_cast<G*>(p)->~G(); }
+                    static const vtable table;
+                };
+
+                template <typename G>
+                struct remote {
+                    static void call(void* p, Args... args) { (**static_cast<G**>(p))(args...); }
+                    static void move(void* from, void* to) { *static_cast<G**>(to) = *static_cast<G**>(from); }
+                    static void destroy(void* p) { delete *static_cast<G**>(p); }
+                    static const vtable table;
+                };
+
+                template <typename G, typename F>
+                void store(F&& f, std::true_type) {
+                    new (&buf) G(std::forward<F>(f));
+                    ops = &local<G>::table;
+                }
+
+                template <typename G, typename F>
+                void store(F&& f, std::false_type) {
+                    *reinterpret_cast<G**>(&buf) = new G(std::forward<F>(f));
+                    ops = &remote<G>::table;
+                }
+
+                storage buf;
+                const vtable* ops;
+        };
+
+        template <typename... Args>
+        template <typename G>
+        const typename basic_small_action<Args...>::vtable basic_small_action<Args...>::local<G>::table = {
+            &basic_small_action<Args...>::local<G>::call,
+            &basic_small_action<Args...>::local<G>::move,
+            &basic_small_action<Args...>::local<G>::destroy
+        };
+
+        template <typename... Args>
+        template <typename G>
+        const typename basic_small_action<Args...>::vtable basic_small_action<Args...>::remote<G>::table = {
+            &basic_small_action<Args...>::remote<G>::call,
+            &basic_small_action<Args...>::remote<G>::move,
+            &basic_small_action<Args...>::remote<G>::destroy
+        };
+
+        typedef basic_small_action<> small_action;
+    }
+}
+
+#endif
@@ -25,9 +25,10 @@ namespace sodium {
                     transaction_impl* trans,
                     const std::shared_ptr<impl::node>& target,
                     std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>* handler,
-                    bool suppressEarlierFirings) const
+                    bool suppressEarlierFirings,
+                    bool parallel_safe) const
         {
-            std::shared_ptr<holder> h(new holder(handler));
+            std::shared_ptr<holder> h(new_shared<holder>(handler, parallel_safe));
             return listen_impl(trans, target, h, suppressEarlierFirings);
         }
 
@@ -80,9 +81,7 @@ namespace sodium {
             std::tuple<impl::stream_,std::shared_ptr<impl::node> > p = impl::unsafe_new_stream();
             std::shared_ptr<impl::node> left(new impl::node);
             const std::shared_ptr<impl::node>& right = std::get<1>(p);
-            char* h = new char;
-            if (left->link(h, right))
-                trans1->to_regen = true;
+            size_t link_handle = left->link(NULL, right);
             // defer right side to make sure merge is left-biased
             auto kill1 = this->listen_raw(trans1, left,
                 new std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>(
@@ -90,9 +89,8 @@ namespace sodium {
                         send(right, trans2, a);
                     }), false);
             auto kill2 = other.listen_raw(trans1, right, NULL, false);
-            auto kill3 = new std::function<void()>([left, h] () {
-                left->unlink(h);
-                delete h;
+            auto kill3 = new std::function<void()>([left, link_handle] () {
+                left->unlink(link_handle);
             });
             return std::get<0>(p).unsafe_add_cleanup(kill1, kill2, kill3);
         }
@@ -123,7 +121,7 @@ namespace sodium {
                         }
                         else
                             pState->oValue = make_optional(combine(pState->oValue.get(), ptr));
-                    }), false);
+                    }), false, true);
             return std::get<0>(p).unsafe_add_cleanup(kill);
         }
 
@@ -134,6 +132,185 @@ namespace sodium {
             });
         }
 
+        namespace {
+            typedef std::function<boost::optional<light_ptr>(const light_ptr&)> stage_func;
+
+            /*!
+             * A stage given as an untyped function.
+             */
+            struct function_stage : stage_fn {
+                function_stage(const stage_func& f_) : f(f_) {}
+                stage_func f;
+                virtual const light_ptr* apply(const light_ptr& in, light_ptr& out) const {
+                    boost::optional<light_ptr> oa = f(in);
+                    if (!oa)
+                        return NULL;
+                    out = std::move(oa.get());
+                    return &out;
+                }
+            };
+
+            /*!
+             * The one listener of a stage that has only one, which listens to the
+             * stage's input with the stage fused into its handler.
+             */
+            struct fused_listener {
+                fused_listener(const std::shared_ptr<node>& target_, const std::shared_ptr<holder>& h_)
+                    : target(target_), h(h_), kill(NULL), live(true) {}
+                std::shared_ptr<node> target;
+                std::shared_ptr<holder> h;
+                std::function<void()>* kill;  // Its current link, if any
+                bool live;                    // It hasn't been unlistened
+            };
+
+            /*!
+             * Everything here is only touched in a transaction on the input's partition.
+             */
+            struct stage_state {
+                stage_state(const stream_& input_, const std::shared_ptr<const stage_fn>& f_)
+                    : input(input_), f(f_), consumers(0) {}
+                stream_ input;
+                std::shared_ptr<const stage_fn> f;
+                int consumers;                            // Listeners of the stage
+                std::shared_ptr<fused_listener> fused;    // The listener, while there's only one
+                stream_ materialized;                     // A node of our own, once there are more
+                // Stands in for the node a stream would normally have, to keep the stage
+                // active for as long as the stream is referenced.
+                boost::intrusive_ptr<listen_impl_func<H_NODE> > self;
+
+                /*!
+                 * Forget a listener, dropping our node once there are none left so the
+                 * next one is fused again.
+                 */
+                void release() {
+                    if (--consumers == 0)
+                        materialized = stream_();
+                }
+            };
+
+            /*!
+             * Wrap h so it gets f's output instead of the input value.
+             */
+            std::shared_ptr<holder> fuse(const std::shared_ptr<const stage_fn>& f, const std::shared_ptr<holder>& h)
+            {
+                return new_shared<holder>(f, h);
+            }
+
+            /*!
+             * The most stages that are fused in a row. Listening, firing and unlistening
+             * go through a fused chain recursively, so a longer chain gets a node every
+             * this many stages.
+             */
+            const unsigned max_fused = 64;
+
+            /*!
+             * How many fused stages the stream li is at the end of, up to max_fused.
+             */
+            unsigned fused_depth(listen_impl_func<H_STREAM>* li)
+            {
+                unsigned depth = 0;
+                for (; li != NULL && li->owner == NULL && li->input != NULL && depth < max_fused;
+                        li = li->input)
+                    depth++;
+                return depth;
+            }
+        }
+
+        /*!
+         * A stateless stage (map, filter and the like) gets no node of its own while
+         * it has one listener. That listener listens to the input with f composed
+         * into its handler, so a chain of stages costs one step per firing. When a
+         * second listener comes, the stage gets a node that all its listeners share,
+         * so f still runs once per firing. When the last listener goes, so does the
+         * node.
+         */
+        stream_ stage_(transaction_impl* trans1, const stream_& input, const std::shared_ptr<const stage_fn>& f)
+        {
+            if (fused_depth(input.p_listen_impl.get()) >= max_fused) {
+                std::tuple<stream_, std::shared_ptr<node> > p = unsafe_new_stream(input.part());
+                std::function<void()>* kill = input.listen_impl(trans1, std::get<1>(p),
+                    fuse(f, std::shared_ptr<holder>(new holder(NULL))), false);
+                return std::get<0>(p).unsafe_add_cleanup(kill);
+            }
+            std::shared_ptr<stage_state> state(new stage_state(input, f));
+            boost::intrusive_ptr<listen_impl_func<H_STRONG> > impl(
+                new listen_impl_func<H_STRONG>(new listen_impl_func<H_STRONG>::closure([state] (transaction_impl* trans2,
+                        const std::shared_ptr<node>& target,
+                        const std::shared_ptr<holder>& h,
+                        bool suppressEarlierFirings) -> std::function<void()>* {
+                    partition* part = trans2->part;
+                    if (state->consumers == 0) {
+                        std::shared_ptr<fused_listener> l(new fused_listener(target, h));
+                        l->kill = state->input.listen_impl(trans2, target, fuse(state->f, h), suppressEarlierFirings);
+                        if (l->kill == NULL)
+                            return NULL;
+                        state->consumers++;
+                        state->fused = l;
+                        return new std::function<void()>([state, l, part] () {
+                            transaction_ trans3(part);
+                            l->live = false;
+                            if (l->kill != NULL) {
+                                (*l->kill)();
+                                delete l->kill;
+                                l->kill = NULL;
+                            }
+                            if (state->fused == l)
+                                state->fused.reset();
+                            state->release();
+                        });
+                    }
+                    if (!alive(state->materialized.p_listen_impl)) {
+                        std::tuple<stream_, std::shared_ptr<node> > p = unsafe_new_stream(part);
+                        std::function<void()>* kill = state->input.listen_impl(trans2, std::get<1>(p),
+                            fuse(state->f, std::shared_ptr<holder>(new holder(NULL))), suppressEarlierFirings);
+                        state->materialized = std::get<0>(p).unsafe_add_cleanup(kill);
+                        // Move the fused listener onto the new node at the end of the
+                        // transaction, so it gets each firing once: from the input until
+                        // then, and from the node afterwards. Its link to the input is
+                        // only taken away in a last action, so queue the new link to
+                        // follow that.
+                        std::shared_ptr<fused_listener> l(std::move(state->fused));
+                        if (l)
+                            trans2->last([state, l, part] () {
+                                if (!l->live)
+                                    return;
+                                transaction_ trans3(part);
+                                (*l->kill)();
+                                delete l->kill;
+                                l->kill = NULL;
+                                trans3.impl()->last([state, l, part] () {
+                                    if (l->live) {
+                                        transaction_ trans4(part);
+                                        l->kill = state->materialized.listen_impl(trans4.impl(), l->target, l->h, true);
+                                    }
+                                });
+                            });
+                    }
+                    std::function<void()>* kill = state->materialized.listen_impl(trans2, target, h, suppressEarlierFirings);
+                    if (kill == NULL)
+                        return NULL;
+                    state->consumers++;
+                    return new std::function<void()>([state, kill, part] () {
+                        transaction_ trans3(part);
+                        (*kill)();
+                        delete kill;
+                        state->release();
+                    });
+                }))
+            );
+            impl->input = input.p_listen_impl.get();
+            impl->part = input.part();
+            state->self = boost::intrusive_ptr<listen_impl_func<H_NODE> >(
+                reinterpret_cast<listen_impl_func<H_NODE>*>(impl.get()));
+            return stream_(boost::intrusive_ptr<listen_impl_func<H_STREAM> >(
+                reinterpret_cast<listen_impl_func<H_STREAM>*>(impl.get())));
+        }
+
+        stream_ stage_(transaction_impl* trans1, const stream_& input, const stage_func& f)
+        {
+            return stage_(trans1, input, std::make_shared<function_stage>(f));
+        }
+
         /*!
          * Sample the cell's value as at the transaction before the
          * current one, i.e. no changes from the current transaction are
@@ -160,13 +337,9 @@ namespace sodium {
                 const std::function<bool(const light_ptr&)>& pred
             ) const
         {
-            std::tuple<impl::stream_,std::shared_ptr<impl::node> > p = impl::unsafe_new_stream();
-            auto kill = listen_raw(trans1, std::get<1>(p),
-                    new std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>(
-                        [pred] (const std::shared_ptr<impl::node>& target, impl::transaction_impl* trans2, const light_ptr& ptr) {
-                            if (pred(ptr)) send(target, trans2, ptr);
-                        }), false);
-            return std::get<0>(p).unsafe_add_cleanup(kill);
+            return stage_(trans1, *this, [pred] (const light_ptr& ptr) -> boost::optional<light_ptr> {
+                return pred(ptr) ? boost::optional<light_ptr>(ptr) : boost::optional<light_ptr>();
+            });
         }
 
         cell_impl::cell_impl()
@@ -195,27 +368,10 @@ namespace sodium {
          */
         void send(const std::shared_ptr<node>& n, transaction_impl* trans1, const light_ptr& a)
         {
-            if (n->firings.begin() == n->firings.end())
-                trans1->last([n] () {
-                    n->firings.clear();
-                });
-            n->firings.push_front(a);
-            std::forward_list<node::target>::iterator it = n->targets.begin();
-            while (it != n->targets.end()) {
-                node::target* f = &*it;
-                trans1->prioritized(f->n, [f, a] (transaction_impl* trans2) {
-                    trans2->inCallback++;
-                    try {
-                        ((holder*)f->h)->handle(f->n, trans2, a);
-                        trans2->inCallback--;
-                    }
-                    catch (...) {
-                        trans2->inCallback--;
-                        throw;
-                    }
-                });
-                it++;
-            }
+            if (n->firings.empty())
+                trans1->add_fired(n);
+            n->firings.push_back(a);
+            trans1->prioritized(n.get(), n->firings.size() - 1);
         }
 
         /*!
@@ -223,33 +379,40 @@ namespace sodium {
          */
         std::tuple<stream_, std::shared_ptr<node> > unsafe_new_stream()
         {
-            std::shared_ptr<node> n1(new node);
+            return unsafe_new_stream(current_partition());
+        }
+
+        std::tuple<stream_, std::shared_ptr<node> > unsafe_new_stream(partition* part)
+        {
+            std::shared_ptr<node> n1(new_shared<node>());
             std::weak_ptr<node> n_weak(n1);
             boost::intrusive_ptr<listen_impl_func<H_STRONG> > impl(
-                new listen_impl_func<H_STRONG>(new listen_impl_func<H_STRONG>::closure([n_weak] (transaction_impl* trans1,
+                new listen_impl_func<H_STRONG>(new listen_impl_func<H_STRONG>::closure([n_weak, part] (transaction_impl* trans1,
                         const std::shared_ptr<node>& target,
                         const std::shared_ptr<holder>& h,
                         bool suppressEarlierFirings) -> std::function<void()>* {  // Register listener
                     std::shared_ptr<node> n2 = n_weak.lock();
                     if (n2) {
-                        transaction_impl::part->mx.lock();
-                        if (n2->link(h.get(), target))
-                            trans1->to_regen = true;
-                        transaction_impl::part->mx.unlock();
-                        if (!suppressEarlierFirings && n2->firings.begin() != n2->firings.end()) {
-                            std::forward_list<light_ptr> firings = n2->firings;
-                            trans1->prioritized(target, [target, h, firings] (transaction_impl* trans2) {
-                                for (std::forward_list<light_ptr>::const_iterator it = firings.begin(); it != firings.end(); it++)
-                                    h->handle(target, trans2, *it);
+                        trans1->part->mx.lock();
+                        size_t link_handle = n2->link(h.get(), target);
+                        trans1->part->mx.unlock();
+                        if (!suppressEarlierFirings && !n2->firings.empty()) {
+                            // Replay the firings so far, newest first, straight from n2. The
+                            // transaction's fired list keeps them until it ends. Any that
+                            // come after this point reach the target through the link.
+                            size_t count = n2->firings.size();
+                            trans1->prioritized(target, [target, h, n2, count] (transaction_impl* trans2) {
+                                for (size_t i = count; i-- > 0; )
+                                    h->handle(target, trans2, n2->firings[i]);
                             });
                         }
                         std::shared_ptr<holder>* h_keepalive = new std::shared_ptr<holder>(h);
-                        return new std::function<void()>([n_weak, h_keepalive] () {  // Unregister listener
-                            impl::transaction_ trans2;
-                            trans2.impl()->last([n_weak, h_keepalive] () {
+                        return new std::function<void()>([n_weak, h_keepalive, part, link_handle] () {  // Unregister listener
+                            impl::transaction_ trans2(part);
+                            trans2.impl()->last([n_weak, h_keepalive, link_handle] () {
                                 std::shared_ptr<node> n3 = n_weak.lock();
                                 if (n3)
-                                    n3->unlink((*h_keepalive).get());
+                                    n3->unlink(link_handle);
                                 delete h_keepalive;
                             });
                         });
@@ -258,6 +421,8 @@ namespace sodium {
                         return NULL;
                 }))
             );
+            impl->owner = n1.get();
+            impl->part = part;
             n1->listen_impl = boost::intrusive_ptr<listen_impl_func<H_NODE> >(
                 reinterpret_cast<listen_impl_func<H_NODE>*>(impl.get()));
             boost::intrusive_ptr<listen_impl_func<H_STREAM> > li_stream(
@@ -266,6 +431,7 @@ namespace sodium {
         }
 
         stream_sink_impl::stream_sink_impl()
+            : part(NULL)
         {
         }
 
@@ -273,6 +439,7 @@ namespace sodium {
         {
             std::tuple<impl::stream_,std::shared_ptr<impl::node> > p = impl::unsafe_new_stream();
             this->target = std::get<1>(p);
+            this->part = current_partition();
             return std::get<0>(p);
         }
 
@@ -295,7 +462,7 @@ namespace sodium {
                 );
                 std::weak_ptr<cell_impl_concrete<cell_state> > impl_weak(impl);
                 impl->kill =
-                    input.listen_raw(trans0, std::shared_ptr<node>(new node(SODIUM_IMPL_RANK_T_MAX)),
+                    input.listen_raw(trans0, new_shared<node>(SODIUM_IMPL_RANK_T_MAX),
                     new std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>(
                         [impl_weak] (const std::shared_ptr<impl::node>& target, transaction_impl* trans, const light_ptr& ptr) {
                             std::shared_ptr<cell_impl_concrete<cell_state> > impl_ = impl_weak.lock();
@@ -321,7 +488,7 @@ namespace sodium {
                 new cell_impl_concrete<cell_state_lazy>(input, state, std::shared_ptr<cell_impl>())
             );
             impl->kill =
-                input.listen_raw(trans0, std::shared_ptr<node>(new node(SODIUM_IMPL_RANK_T_MAX)),
+                input.listen_raw(trans0, new_shared<node>(SODIUM_IMPL_RANK_T_MAX),
                 new std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>(
                     [impl] (const std::shared_ptr<impl::node>& target, transaction_impl* trans, const light_ptr& ptr) {
                         bool first = !impl->state.update;
@@ -411,9 +578,7 @@ namespace sodium {
                     std::shared_ptr<impl::node> in_target(new impl::node);
                     std::tuple<impl::stream_,std::shared_ptr<impl::node> > p = impl::unsafe_new_stream();
                     const std::shared_ptr<impl::node>& out_target = std::get<1>(p);
-                    char* h = new char;
-                    if (in_target->link(h, out_target))
-                        trans0->to_regen = true;
+                    size_t link_handle = in_target->link(NULL, out_target);
                     auto output = [state, out_target] (transaction_impl* trans) {
                         auto f = *state->f.get().cast_ptr<std::function<light_ptr(const light_ptr&)>>(NULL);
                         send(out_target, trans, f(state->a.get()));
@@ -441,9 +606,8 @@ namespace sodium {
                                     }
                                 }
                             ), false);
-                    auto kill3 = new std::function<void()>([in_target, h] () {
-                        in_target->unlink(h);
-                        delete h;
+                    auto kill3 = new std::function<void()>([in_target, link_handle] () {
+                        in_target->unlink(link_handle);
                     });
                     return std::get<0>(p).unsafe_add_cleanup(kill1, kill2, kill3).hold_lazy_(
                         trans0, [bf, ba] () -> light_ptr {
@@ -473,13 +637,9 @@ namespace sodium {
             const std::function<light_ptr(const light_ptr&)>& f,
             const stream_& ev)
         {
-            std::tuple<impl::stream_,std::shared_ptr<impl::node> > p = impl::unsafe_new_stream();
-            auto kill = ev.listen_raw(trans1, std::get<1>(p),
-                    new std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>(
-                        [f] (const std::shared_ptr<impl::node>& target, impl::transaction_impl* trans2, const light_ptr& ptr) {
-                            send(target, trans2, f(ptr));
-                        }), false);
-            return std::get<0>(p).unsafe_add_cleanup(kill);
+            return stage_(trans1, ev, [f] (const light_ptr& ptr) -> boost::optional<light_ptr> {
+                return boost::optional<light_ptr>(f(ptr));
+            });
         }
 
         cell_ map_(transaction_impl* trans,
@@ -559,15 +719,7 @@ namespace sodium {
         stream_ filter_optional_(transaction_impl* trans1, const stream_& input,
             const std::function<boost::optional<light_ptr>(const light_ptr&)>& f)
         {
-            auto p = impl::unsafe_new_stream();
-            auto kill = input.listen_raw(trans1, std::get<1>(p),
-                new std::function<void(const std::shared_ptr<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
-                    [f] (const std::shared_ptr<impl::node>& target, impl::transaction_impl* trans2, const light_ptr& poa) {
-                        boost::optional<light_ptr> oa = f(poa);
-                        if (oa) impl::send(target, trans2, oa.get());
-                    })
-                , false);
-            return std::get<0>(p).unsafe_add_cleanup(kill);
+            return stage_(trans1, input, f);
         }
 
     };  // end namespace impl
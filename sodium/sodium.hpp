@@ -48,9 +48,12 @@ namespace sodium {
     template <typename A>
     stream<A> split(const stream<std::list<A>>& e);
     template <typename A>
+    stream<A> cross(const stream<A>& sa, partition* to);
+    template <typename A>
     stream<A> switch_s(const cell<stream<A>>& bea);
     template <typename T>
     cell<typename T::time> clock(const T& t);
+    class graph_inspector;
 
     template <typename A>
     class lazy {
@@ -113,9 +116,16 @@ namespace sodium {
         friend stream_ switch_s(transaction_impl* trans, const cell_& bea);
         template <typename A>
         friend stream<A> sodium::split(const stream<std::list<A>>& e);
+        template <typename A>
+        friend stream<A> sodium::cross(const stream<A>& sa, partition* to);
         friend stream_ filter_optional_(transaction_impl* trans, const stream_& input,
             const std::function<boost::optional<light_ptr>(const light_ptr&)>& f);
+        friend stream_ stage_(transaction_impl* trans, const stream_& input,
+            const std::function<boost::optional<light_ptr>(const light_ptr&)>& f);
+        friend stream_ stage_(transaction_impl* trans, const stream_& input,
+            const std::shared_ptr<const stage_fn>& f);
         template <typename A, typename Selector> friend class sodium::router;
+        friend class sodium::graph_inspector;
 
         protected:
             boost::intrusive_ptr<listen_impl_func<H_STREAM> > p_listen_impl;
@@ -129,6 +139,14 @@ namespace sodium {
             bool is_never() const { return !impl::alive(p_listen_impl); }
 #endif
 
+            /*!
+             * The partition the stream belongs to. A stream that never fires belongs to
+             * whichever partition is current.
+             */
+            partition* part() const {
+                return p_listen_impl ? p_listen_impl->part : current_partition();
+            }
+
         protected:
 
             /*!
@@ -138,7 +156,8 @@ namespace sodium {
                         transaction_impl* trans0,
                         const std::shared_ptr<impl::node>& target,
                         std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>* handle,
-                        bool suppressEarlierFirings) const;
+                        bool suppressEarlierFirings,
+                        bool parallel_safe = false) const;
 
             /*!
              * This is far more efficient than add_cleanup because it modifies the stream
@@ -254,6 +273,55 @@ namespace sodium {
                    }
         stream_ map_(transaction_impl* trans, const std::function<light_ptr(const light_ptr&)>& f, const stream_& ca);
 
+        /*!
+         * A stream that applies f to the values of input.
+         */
+        stream_ stage_(transaction_impl* trans, const stream_& input, const std::shared_ptr<const stage_fn>& f);
+
+#if !defined(SODIUM_NO_TYPED_STAGES)
+        /*!
+         * Typed stages for stream<A>::map() and filter(). Unlike going through
+         * SODIUM_DETYPE_FUNCTION1, they call the functor directly, so it can be
+         * inlined, and there is one virtual call per value. The functor may be a
+         * mutable lambda. Define SODIUM_NO_TYPED_STAGES to use the untyped functions
+         * instead.
+         */
+        template <typename A, typename B, typename Fn>
+        struct map_stage : stage_fn {
+            map_stage(const Fn& f_) : f(f_) {}
+            mutable typename std::decay<Fn>::type f;
+            virtual const light_ptr* apply(const light_ptr& in, light_ptr& out) const {
+                out = light_ptr::create<B>(f(*in.cast_ptr<A>(NULL)));
+                return &out;
+            }
+        };
+
+        template <typename A, typename Pred>
+        struct filter_stage : stage_fn {
+            filter_stage(const Pred& pred_) : pred(pred_) {}
+            mutable typename std::decay<Pred>::type pred;
+            virtual const light_ptr* apply(const light_ptr& in, light_ptr&) const {
+                return pred(*in.cast_ptr<A>(NULL)) ? &in : NULL;
+            }
+        };
+
+        /*!
+         * The state of accum_s() or collect(). The initial value is only evaluated
+         * when it's first needed, and after that the state is kept as a plain S.
+         */
+        template <typename S>
+        struct lazy_state {
+            lazy_state(const lazy<S>& init_) : init(init_) {}
+            const S& get() {
+                if (!value)
+                    value = init();
+                return value.get();
+            }
+            lazy<S> init;
+            boost::optional<S> value;
+        };
+#endif
+
         /*!
          * Function to push a value into an stream
          */
@@ -267,6 +335,14 @@ namespace sodium {
                 std::shared_ptr<node>
             > unsafe_new_stream();
 
+        /*!
+         * Creates an stream belonging to the specified partition.
+         */
+        std::tuple<
+                stream_,
+                std::shared_ptr<node>
+            > unsafe_new_stream(partition* part);
+
         struct cell_impl {
             cell_impl();
             cell_impl(
@@ -389,6 +465,11 @@ namespace sodium {
 
                 stream_ value_(transaction_impl* trans) const;
                 const stream_& updates_() const { return impl->updates; }
+
+                /*!
+                 * The partition the cell belongs to, which is that of its updates.
+                 */
+                partition* part() const { return impl ? impl->updates.part() : current_partition(); }
         };
 
         cell_ map_(transaction_impl* trans, const std::function<light_ptr(const light_ptr&)>& f,
@@ -404,6 +485,7 @@ namespace sodium {
      */
     template <typename A>
     class cell : protected impl::cell_ {
+        friend class graph_inspector;
         template <typename AA> friend class stream;
         template <typename AA> friend class cell;
         template <typename AA> friend class cell_loop;
@@ -413,6 +495,8 @@ namespace sodium {
         friend cell<AA> switch_c(const cell<cell<AA>>& bba);
         template <typename AA>
         friend stream<AA> switch_s(const cell<stream<AA>>& bea);
+        template <typename AA, typename BB, typename CC>
+        friend cell<CC> lift(const std::function<CC(const AA&, const BB&)>& f, const cell<AA>& ba, const cell<BB>& bb);
         template <typename TT>
         friend cell<typename TT::time> clock(const TT& t);
         private:
@@ -443,7 +527,7 @@ namespace sodium {
              * Sample the value of this cell.
              */
             A sample() const {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 A a = *impl->sample().template cast_ptr<A>(NULL);
                 trans.close();
                 return a;
@@ -452,7 +536,7 @@ namespace sodium {
             lazy<A> sample_lazy() const {
                 const std::shared_ptr<impl::cell_impl>& impl_(this->impl);
                 return lazy<A>([impl_] () -> A {
-                    transaction trans;
+                    transaction trans(impl::graph_partition(impl_->updates.part()));
                     A a = *impl_->sample().template cast_ptr<A>(NULL);
                     trans.close();
                     return a;
@@ -464,7 +548,7 @@ namespace sodium {
              * it will be executed when no copies of the new cell are referenced.
              */
             cell<A> add_cleanup(const std::function<void()>& cleanup) const {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 cell<A> ca = updates().add_cleanup(cleanup).hold(sample());
                 trans.close();
                 return ca;
@@ -476,7 +560,7 @@ namespace sodium {
             template <typename Fn>
             cell<typename std::result_of<Fn(A)>::type> map(const Fn& f) const {
                 typedef typename std::result_of<Fn(A)>::type B;
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 auto ca = cell<B>(impl::map_(trans.impl(), SODIUM_DETYPE_FUNCTION1(A,B,f), *this));
                 trans.close();
                 return ca;
@@ -494,7 +578,7 @@ namespace sodium {
                         return [f, a] (const B& b) -> C { return f(a, b); };
                     }
                 );
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 auto ca = apply<B, C>(map(fa), bb);
                 trans.close();
                 return ca;
@@ -660,7 +744,7 @@ namespace sodium {
              * giving the current value.
              */
             stream<A> value() const {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 stream<A> sa = stream<A>(value_(trans.impl())).coalesce([] (const A&, const A& b) { return b; });
                 trans.close();
                 return sa;
@@ -679,7 +763,7 @@ namespace sodium {
              *   your own primitives.
              */
             std::function<void()> listen(const std::function<void(const A&)>& handle) const {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 auto kill = stream<A>(value_(trans.impl())).coalesce([] (const A&, const A& b) { return b; }).listen(handle);
                 trans.close();
                 return kill;
@@ -693,13 +777,13 @@ namespace sodium {
              * is the return cell's type, and S is the state type.
              */
             template <typename S, typename Fn>
-            cell<typename std::tuple_element<0,typename std::result_of<Fn(A,S)>::type>::type> collect_lazy(
+            cell<typename std::tuple_element<0,typename std::result_of<typename std::decay<Fn>::type(A,S)>::type>::type> collect_lazy(
                 const lazy<S>& initS,
                 const Fn& f
             ) const
             {
-                typedef typename std::tuple_element<0,typename std::result_of<Fn(A,S)>::type>::type B;
-                transaction trans1;
+                typedef typename std::tuple_element<0,typename std::result_of<typename std::decay<Fn>::type(A,S)>::type>::type B;
+                transaction trans1(impl::graph_partition(this->part()));
                 auto ea = updates().coalesce([] (const A&, const A& snd) -> A { return snd; });
                 lazy<A> za_lazy = sample_lazy();
                 std::function<std::tuple<B,S>()> zbs = [za_lazy, initS, f] () -> std::tuple<B,S> {
@@ -734,7 +818,7 @@ namespace sodium {
              * is the return cell's type, and S is the state type.
              */
             template <typename S, typename Fn>
-            cell<typename std::tuple_element<0,typename std::result_of<Fn(A,S)>::type>::type> collect(
+            cell<typename std::tuple_element<0,typename std::result_of<typename std::decay<Fn>::type(A,S)>::type>::type> collect(
                 const S& initS,
                 const Fn& f
             ) const
@@ -746,6 +830,7 @@ namespace sodium {
 
     template <typename A>
     class stream : protected impl::stream_ {
+        friend class graph_inspector;
         template <typename AA> friend class stream;
         template <typename AA> friend class sodium::stream_sink;
         template <typename AA> friend class cell;
@@ -754,6 +839,7 @@ namespace sodium {
         template <typename AA> friend stream<AA> filter_optional(const stream<boost::optional<AA>>& input);
         template <typename AA> friend stream<AA> switch_s(const cell<stream<AA>>& bea);
         template <typename AA> friend stream<AA> split(const stream<std::list<AA>>& e);
+        template <typename AA> friend stream<AA> cross(const stream<AA>& sa, partition* to);
         template <typename AA> friend class sodium::stream_loop;
         template <typename AA, typename Selector> friend class sodium::router;
         public:
@@ -768,9 +854,9 @@ namespace sodium {
              * High-level interface to obtain an stream's value.
              */
             std::function<void()> listen(const std::function<void(const A&)>& handle) const {
-                transaction trans1;
+                transaction trans1(impl::graph_partition(this->part()));
                 std::function<void()>* pKill = listen_raw(trans1.impl(),
-                    std::shared_ptr<impl::node>(new impl::node(SODIUM_IMPL_RANK_T_MAX)),
+                    impl::new_shared<impl::node>(SODIUM_IMPL_RANK_T_MAX),
                     new std::function<void(const std::shared_ptr<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
                         [handle] (const std::shared_ptr<impl::node>&, impl::transaction_impl*, const light_ptr& ptr) {
                             handle(*ptr.cast_ptr<A>(NULL));
@@ -804,10 +890,16 @@ namespace sodium {
              * pure (referentially transparent), that is, it must not have effects.
              */
             template <typename Fn>
-            stream<typename std::result_of<Fn(A)>::type> map(const Fn& f) const {
-                typedef typename std::result_of<Fn(A)>::type B;
-                transaction trans;
-                auto sa = stream<B>(impl::map_(trans.impl(), SODIUM_DETYPE_FUNCTION1(A,B,f), *this));
+            stream<typename std::result_of<typename std::decay<Fn>::type(A)>::type> map(const Fn& f) const {
+                typedef typename std::result_of<typename std::decay<Fn>::type(A)>::type B;
+                transaction trans(impl::graph_partition(this->part()));
+#if defined(SODIUM_NO_TYPED_STAGES)
+                std::function<B(const A&)> fn(f);
+                auto sa = stream<B>(impl::map_(trans.impl(), SODIUM_DETYPE_FUNCTION1(A,B,fn), *this));
+#else
+                auto sa = stream<B>(impl::stage_(trans.impl(), *this,
+                    std::make_shared<impl::map_stage<A, B, Fn> >(f)));
+#endif
                 trans.close();
                 return sa;
             }
@@ -819,7 +911,7 @@ namespace sodium {
             template <typename Fn>
             stream<typename std::remove_reference<decltype(std::declval<typename std::result_of<Fn(A)>::type>().get())>::type> map_optional(const Fn& f) const {
                 using B = typename std::remove_reference<decltype(std::declval<typename std::result_of<Fn(A)>::type>().get())>::type;
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 auto sa = filter_optional<B>(map(f));
                 trans.close();
                 return sa;
@@ -875,7 +967,7 @@ namespace sodium {
              */
             stream<A> coalesce(const std::function<A(const A&, const A&)>& combine) const
             {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 stream<A> sa(coalesce_(trans.impl(),
                     [combine] (const light_ptr& a, const light_ptr& b) -> light_ptr {
                         return light_ptr::create<A>(combine(*a.cast_ptr<A>(NULL), *b.cast_ptr<A>(NULL)));
@@ -900,7 +992,7 @@ namespace sodium {
              */
             stream<A> merge(const stream<A>& s, const std::function<A(const A&, const A&)>& f) const
             {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 stream<A> sa = stream<A>(merge_(trans.impl(), s)).coalesce(f);
                 trans.close();
                 return sa;
@@ -910,14 +1002,21 @@ namespace sodium {
              * Filter this stream based on the specified predicate, passing through values
              * where the predicate returns true.
              */
-            stream<A> filter(const std::function<bool(const A&)>& pred) const
+            template <typename Pred>
+            stream<A> filter(const Pred& pred) const
             {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
+#if defined(SODIUM_NO_TYPED_STAGES)
+                std::function<bool(const A&)> f(pred);
                 stream<A> sa = stream<A>(filter_(trans.impl(),
-                    [pred] (const light_ptr& a) {
-                        return pred(*a.cast_ptr<A>(NULL));
+                    [f] (const light_ptr& a) {
+                        return f(*a.cast_ptr<A>(NULL));
                     }
                   ));
+#else
+                stream<A> sa = stream<A>(impl::stage_(trans.impl(), *this,
+                    std::make_shared<impl::filter_stage<A, Pred> >(pred)));
+#endif
                 trans.close();
                 return sa;
             }
@@ -930,7 +1029,7 @@ namespace sodium {
              */
             cell<A> hold(const A& initA) const
             {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 cell<A> ca(hold_(trans.impl(), light_ptr::create<A>(initA)));
                 trans.close();
                 return ca;
@@ -938,7 +1037,7 @@ namespace sodium {
 
             cell<A> hold(A&& initA) const
             {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 cell<A> ca(hold_(trans.impl(), light_ptr::create<A>(std::move(initA))));
                 trans.close();
                 return ca;
@@ -946,7 +1045,7 @@ namespace sodium {
 
             cell<A> hold_lazy(const lazy<A>& initA) const
             {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 cell<A> ca(hold_lazy_(trans.impl(), [initA] () -> light_ptr { return light_ptr::create<A>(initA()); }));
                 trans.close();
                 return ca;
@@ -961,7 +1060,7 @@ namespace sodium {
             stream<typename std::result_of<Fn(A,B)>::type> snapshot(const cell<B>& beh, const Fn& combine) const
             {
                 typedef typename std::result_of<Fn(A,B)>::type C;
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 auto sa = stream<C>(snapshot_(trans.impl(), beh,
                     [combine] (const light_ptr& a, const light_ptr& b) -> light_ptr {
                         return light_ptr::create<C>(combine(*a.cast_ptr<A>(NULL), *b.cast_ptr<B>(NULL)));
@@ -1032,7 +1131,7 @@ namespace sodium {
              */
             stream<A> gate(const cell<bool>& g) const
             {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 stream<A> sa = filter_optional<A>(snapshot(
                     g,
                     [] (const A& a, const bool& gated) {
@@ -1051,23 +1150,36 @@ namespace sodium {
              * is the return cell's type, and S is the state type.
              */
             template <typename S, typename Fn>
-            stream<typename std::tuple_element<0,typename std::result_of<Fn(A,S)>::type>::type> collect_lazy(
+            stream<typename std::tuple_element<0,typename std::result_of<typename std::decay<Fn>::type(A,S)>::type>::type> collect_lazy(
                 const lazy<S>& initS,
                 const Fn& f
             ) const
             {
-                typedef typename std::tuple_element<0,typename std::result_of<Fn(A,S)>::type>::type B;
-                transaction trans1;
-                std::shared_ptr<lazy<S> > pState(new lazy<S>(initS));
+                typedef typename std::tuple_element<0,typename std::result_of<typename std::decay<Fn>::type(A,S)>::type>::type B;
+                transaction trans1(impl::graph_partition(this->part()));
                 std::tuple<impl::stream_,std::shared_ptr<impl::node> > p = impl::unsafe_new_stream();
+#if defined(SODIUM_NO_TYPED_STAGES)
+                std::shared_ptr<lazy<S> > pState(new lazy<S>(initS));
+                std::function<std::tuple<B,S>(const A&, const S&)> f1(f);
                 auto kill = listen_raw(trans1.impl(), std::get<1>(p),
                     new std::function<void(const std::shared_ptr<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
-                        [pState, f] (const std::shared_ptr<impl::node>& target, impl::transaction_impl* trans2, const light_ptr& ptr) {
-                            auto outsSt = f(*ptr.cast_ptr<A>(NULL), (*pState)());
+                        [pState, f1] (const std::shared_ptr<impl::node>& target, impl::transaction_impl* trans2, const light_ptr& ptr) {
+                            auto outsSt = f1(*ptr.cast_ptr<A>(NULL), (*pState)());
                             const S& new_s = std::get<1>(outsSt);
                             *pState = lazy<S>(new_s);
                             send(target, trans2, light_ptr::create<B>(std::get<0>(outsSt)));
                         }), false);
+#else
+                std::shared_ptr<impl::lazy_state<S> > pState(new impl::lazy_state<S>(initS));
+                typename std::decay<Fn>::type fn(f);
+                auto kill = listen_raw(trans1.impl(), std::get<1>(p),
+                    new std::function<void(const std::shared_ptr<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
+                        [pState, fn] (const std::shared_ptr<impl::node>& target, impl::transaction_impl* trans2, const light_ptr& ptr) mutable {
+                            auto outsSt = fn(*ptr.cast_ptr<A>(NULL), pState->get());
+                            pState->value = std::move(std::get<1>(outsSt));
+                            send(target, trans2, light_ptr::create<B>(std::move(std::get<0>(outsSt))));
+                        }), false);
+#endif
                 auto sa = std::get<0>(p).unsafe_add_cleanup(kill);
                 trans1.close();
                 return sa;
@@ -1081,7 +1193,7 @@ namespace sodium {
              * is the return cell's type, and S is the state type.
              */
             template <typename S, typename Fn>
-            stream<typename std::tuple_element<0,typename std::result_of<Fn(A,S)>::type>::type> collect(
+            stream<typename std::tuple_element<0,typename std::result_of<typename std::decay<Fn>::type(A,S)>::type>::type> collect(
                 const S& initS,
                 const Fn& f
             ) const
@@ -1089,32 +1201,46 @@ namespace sodium {
                 return collect_lazy<S,Fn>(lazy<S>(initS), f);
             }
 
-            template <typename B>
+            template <typename B, typename Fn>
             stream<B> accum_s_lazy(
                 const lazy<B>& initB,
-                const std::function<B(const A&, const B&)>& f
+                const Fn& f
             ) const
             {
-                transaction trans1;
-                std::shared_ptr<lazy<B> > pState(new lazy<B>(initB));
+                transaction trans1(impl::graph_partition(this->part()));
                 std::tuple<impl::stream_,std::shared_ptr<impl::node> > p = impl::unsafe_new_stream();
+#if defined(SODIUM_NO_TYPED_STAGES)
+                std::shared_ptr<lazy<B> > pState(new lazy<B>(initB));
+                std::function<B(const A&, const B&)> f1(f);
                 auto kill = listen_raw(trans1.impl(), std::get<1>(p),
                     new std::function<void(const std::shared_ptr<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
-                        [pState, f] (const std::shared_ptr<impl::node>& target, impl::transaction_impl* trans2, const light_ptr& ptr) {
-                            B b = f(*ptr.cast_ptr<A>(NULL), (*pState)());
+                        [pState, f1] (const std::shared_ptr<impl::node>& target, impl::transaction_impl* trans2, const light_ptr& ptr) {
+                            B b = f1(*ptr.cast_ptr<A>(NULL), (*pState)());
                             *pState = lazy<B>(b);
                             send(target, trans2, light_ptr::create<B>(b));
                         })
                     , false);
+#else
+                std::shared_ptr<impl::lazy_state<B> > pState(new impl::lazy_state<B>(initB));
+                typename std::decay<Fn>::type fn(f);
+                auto kill = listen_raw(trans1.impl(), std::get<1>(p),
+                    new std::function<void(const std::shared_ptr<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
+                        [pState, fn] (const std::shared_ptr<impl::node>& target, impl::transaction_impl* trans2, const light_ptr& ptr) mutable {
+                            B b = fn(*ptr.cast_ptr<A>(NULL), pState->get());
+                            send(target, trans2, light_ptr::create<B>(b));
+                            pState->value = std::move(b);
+                        })
+                    , false);
+#endif
                 stream<B> sb(std::get<0>(p).unsafe_add_cleanup(kill));
                 trans1.close();
                 return sb;
             }
 
-            template <typename B>
+            template <typename B, typename Fn>
             stream<B> accum_s(
                 const B& initB,
-                const std::function<B(const A&, const B&)>& f
+                const Fn& f
             ) const
             {
                 return accum_s_lazy<B>(lazy<B>(initB), f);
@@ -1166,7 +1292,7 @@ namespace sodium {
             template<class B>
             cell<B> accum(const B& initA) const
             {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 cell<B> cb = this->accum_s<B>(initA).hold(initA);
                 trans.close();
                 return cb;
@@ -1178,7 +1304,7 @@ namespace sodium {
             template<class B>
             cell<B> accum_lazy(const lazy<B>& initA) const
             {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 cell<B> cb = this->accum_s_lazy<B>(initA).hold_lazy(initA);
                 trans.close();
                 return cb;
@@ -1194,7 +1320,7 @@ namespace sodium {
 
             stream<A> once() const
             {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 stream<A> sa(once_(trans.impl()));
                 trans.close();
                 return sa;
@@ -1227,7 +1353,7 @@ namespace sodium {
              */
             stream<A> add_cleanup(const std::function<void()>& cleanup) const
             {
-                transaction trans;
+                transaction trans(impl::graph_partition(this->part()));
                 stream<A> sa(add_cleanup_(trans.impl(),
                     new std::function<void()>(cleanup)
                 ));
@@ -1252,6 +1378,7 @@ namespace sodium {
             stream_ construct();
             void send(transaction_impl* trans, const light_ptr& ptr) const;
             std::shared_ptr<impl::node> target;
+            partition* part;
         };
     }
 
@@ -1307,7 +1434,7 @@ namespace sodium {
             }
 
             void send(const A& a) const {
-                transaction trans;
+                transaction trans(impl.part);
                 if (trans.impl()->inCallback > 0)
                     throw std::runtime_error("You are not allowed to use send() inside a Sodium callback");
                 impl.send(trans.impl(), light_ptr::create<A>(a));
@@ -1315,7 +1442,7 @@ namespace sodium {
             }
 
             void send(A&& a) const {
-                transaction trans;
+                transaction trans(impl.part);
                 if (trans.impl()->inCallback > 0)
                     throw std::runtime_error("You are not allowed to use send() inside a Sodium callback");
                 impl.send(trans.impl(), light_ptr::create<A>(std::move(a)));
@@ -1334,7 +1461,7 @@ namespace sodium {
     template <typename A>
     stream<A> filter_optional(const stream<boost::optional<A>>& input)
     {
-        transaction trans;
+        transaction trans(impl::graph_partition(input.part()));
         stream<A> sa = impl::filter_optional_(trans.impl(), input, [] (const light_ptr& poa) -> boost::optional<light_ptr> {
             const boost::optional<A>& oa = *poa.cast_ptr<boost::optional<A>>(NULL);
             if (oa)
@@ -1404,7 +1531,7 @@ namespace sodium {
         const cell<std::function<B(const A&)>>& bf,
         const cell<A>& ba)
     {
-        transaction trans;
+        transaction trans(impl::graph_partition(ba.part()));
         cell<B> cb = cell<B>(impl::apply(
             trans.impl(),
             impl::map_(trans.impl(),
@@ -1549,7 +1676,7 @@ namespace sodium {
     template <typename A>
     stream<A> switch_s(const cell<stream<A>>& bea)
     {
-        transaction trans;
+        transaction trans(impl::graph_partition(bea.part()));
         stream<A> sa(impl::switch_s(trans.impl(), bea));
         trans.close();
         return sa;
@@ -1577,7 +1704,7 @@ namespace sodium {
     template <typename A>
     cell<A> switch_c(const cell<cell<A>>& bba)
     {
-        transaction trans;
+        transaction trans(impl::graph_partition(bba.part()));
         cell<A> ca(impl::switch_c(trans.impl(), bba));
         trans.close();
         return ca;
@@ -1610,7 +1737,7 @@ namespace sodium {
                 return [f, a] (const B& b) -> C { return f(a, b); };
             }
         );
-        transaction trans;
+        transaction trans(impl::graph_partition(ba.part()));
         cell<C> cc = apply<B, C>(ba.map(fa), bb);
         trans.close();
         return cc;
@@ -1811,15 +1938,16 @@ namespace sodium {
     template <typename A>
     stream<A> split(const stream<std::list<A>>& e)
     {
-        std::tuple<impl::stream_,std::shared_ptr<impl::node> > p = impl::unsafe_new_stream();
-        transaction trans1;
+        std::tuple<impl::stream_,std::shared_ptr<impl::node> > p = impl::unsafe_new_stream(e.part());
+        transaction trans1(impl::graph_partition(e.part()));
         auto kill = e.listen_raw(trans1.impl(), std::get<1>(p),
             new std::function<void(const std::shared_ptr<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
                 [] (const std::shared_ptr<impl::node>& target, impl::transaction_impl* trans2, const light_ptr& ptr) {
                     const std::list<A>& la = *ptr.cast_ptr<std::list<A>>(NULL);
-                    trans2->part->post([la, target] () {
+                    partition* part = trans2->part;
+                    part->post([la, target, part] () {
                         for (auto it = la.begin(); it != la.end(); ++it) {
-                            transaction trans3;
+                            transaction trans3(part);
                             send(target, trans3.impl(), light_ptr::create<A>(*it));
                             trans3.close();
                         }
@@ -1831,6 +1959,37 @@ namespace sodium {
         return sa;
     }
 
+    /*!
+     * Pass the values of a stream into another partition. The returned stream belongs to
+     * the partition 'to'.
+     *
+     * Each value is sent in a new transaction of its own in the destination partition,
+     * which is started after the source partition's transaction has finished, so neither
+     * partition waits for the other's lock.
+     */
+    template <typename A>
+    stream<A> cross(const stream<A>& sa, partition* to)
+    {
+        std::tuple<impl::stream_,std::shared_ptr<impl::node> > p = impl::unsafe_new_stream(to);
+        std::shared_ptr<impl::node> target = std::get<1>(p);
+        transaction trans1(sa.part());
+        auto kill = sa.listen_raw(trans1.impl(),
+            impl::new_shared<impl::node>(SODIUM_IMPL_RANK_T_MAX),
+            new std::function<void(const std::shared_ptr<impl::node>&, impl::transaction_impl*, const light_ptr&)>(
+                [target, to] (const std::shared_ptr<impl::node>&, impl::transaction_impl* trans2, const light_ptr& ptr) {
+                    light_ptr a = ptr;
+                    trans2->part->post([target, to, a] () {
+                        transaction trans3(to);
+                        send(target, trans3.impl(), a);
+                        trans3.close();
+                    });
+                })
+            , false);
+        stream<A> sa2 = std::get<0>(p).unsafe_add_cleanup(kill);
+        trans1.close();
+        return sa2;
+    }
+
     // New type names:
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
@@ -2,6 +2,6 @@
 
 namespace sodium {
     namespace impl {
-        long long next_seq;
+        std::atomic<long long> next_seq(0);
     };
 };
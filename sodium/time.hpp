@@ -4,6 +4,7 @@
 #include <sodium/sodium.hpp>
 #include <sodium/mutex.hpp>
 #include <memory>
+#include <atomic>
 #include <boost/optional.hpp>
 #include <set>
 
@@ -75,15 +76,15 @@ namespace sodium {
 
     namespace impl {
 
-        extern long long next_seq;
+        extern std::atomic<long long> next_seq;
 
         template <typename T>
         struct event {
             event(T t_, stream_sink<T> sAlarm_snk_)
                 : t(t_), sAlarm_snk(sAlarm_snk_)
             {
-                // This is called inside a listen() handler and this is under a global
-                // transaction lock, so there can't be any race conditions.
+                // Timer systems in different partitions can get here at the same time,
+                // so the counter is atomic.
                 seq = ++next_seq;
             }
             bool operator < (const event& other) const {
@@ -130,6 +131,7 @@ namespace sodium {
             stream<T> at(cell<boost::optional<T>> tAlarm) const
             {
                 transaction trans0;
+                partition* part = trans0.impl()->part;
 
                 stream_sink<T> sAlarm_snk;
 
@@ -137,16 +139,16 @@ namespace sodium {
                 const auto& impl_(this->impl);
                 const auto& event_queue_(this->event_queue);
                 auto kill = tAlarm.value().listen(
-                        [state, impl_, event_queue_, tAlarm, sAlarm_snk] (const boost::optional<T>& o_tAl) {
+                        [state, impl_, event_queue_, tAlarm, sAlarm_snk, part] (const boost::optional<T>& o_tAl) {
                     state->do_cancel(event_queue_);
                     if (o_tAl) {
                         const auto& tAl = o_tAl.get();
                         state->current = boost::make_optional(event<T>(tAl, sAlarm_snk));
                         event_queue_->push(state->current.get());
-                        state->cancel_current = impl_->set_timer(tAl, [] () {
+                        state->cancel_current = impl_->set_timer(tAl, [part] () {
                                     // Open and close a transaction to trigger queued
                                     // events to run.
-                                    transaction trans;
+                                    transaction trans(part);
                                     trans.close();
                                 });
                     }
@@ -5,6 +5,8 @@
  * C++ implementation courtesy of International Telematics Ltd.
  */
 #include <sodium/sodium.hpp>
+#include <algorithm>
+#include <cassert>
 
 using namespace std;
 using namespace boost;
@@ -13,71 +15,109 @@ namespace sodium {
 
 #if defined(SODIUM_SINGLE_THREADED)
     static impl::transaction_impl* global_current_transaction;
+    static impl::transaction_impl::level_output* current_output;
 #else
     static thread_local impl::transaction_impl* global_current_transaction;
+    static thread_local impl::transaction_impl::level_output* current_output;
+#endif
+#if defined(SODIUM_INSTRUMENT)
+#if defined(SODIUM_SINGLE_THREADED)
+    static size_t posts_run;
+#else
+    static thread_local size_t posts_run;  // Posted actions run by this thread
+#endif
 #endif
 
     namespace impl {
 
-        partition* transaction_impl::part;
-
-        void intrusive_ptr_add_ref(sodium::impl::listen_impl_func<sodium::impl::H_STREAM>* p)
+        void holder::handle(const std::shared_ptr<node>& target, transaction_impl* trans, const light_ptr& value) const
         {
-            spin_lock* l = spin_get_and_lock(p);
-            p->counts.inc_stream();
-            l->unlock();
+            if (stage) {
+                light_ptr out;
+                const light_ptr* pout = stage->apply(value, out);
+                if (pout != NULL)
+                    next->handle(target, trans, *pout);
+            }
+            else if (handler)
+                (*handler)(target, trans, value);
+            else
+                send(target, trans, value);
         }
 
-        void intrusive_ptr_release(sodium::impl::listen_impl_func<sodium::impl::H_STREAM>* p)
-        {
-            spin_lock* l = spin_get_and_lock(p);
-            p->counts.dec_stream();
-            p->update_and_unlock(l);
-        }
+    }
 
-        void intrusive_ptr_add_ref(sodium::impl::listen_impl_func<sodium::impl::H_STRONG>* p)
-        {
-            spin_lock* l = spin_get_and_lock(p);
-            p->counts.inc_strong();
-            l->unlock();
-        }
-        
-        void intrusive_ptr_release(sodium::impl::listen_impl_func<sodium::impl::H_STRONG>* p)
-        {
-            spin_lock* l = spin_get_and_lock(p);
-            p->counts.dec_strong();
-            p->update_and_unlock(l);
-        }
+    namespace {
+        struct post_node : impl::mpsc_node {
+            impl::small_action action;
+        };
+
+        /*!
+         * Spare post_nodes. Each thread keeps its own, so taking one needs no
+         * synchronization. A node goes back to the cache of whichever thread ran it.
+         */
+        struct post_node_cache {
+            ~post_node_cache() {
+                for (size_t i = 0; i < nodes.size(); i++)
+                    delete nodes[i];
+            }
+            std::vector<post_node*> nodes;
+        };
+
+#if defined(SODIUM_SINGLE_THREADED)
+        static post_node_cache post_nodes;
+#else
+        static thread_local post_node_cache post_nodes;
+#endif
+
+        /*!
+         * Streams released while this thread was cleaning another one up.
+         */
+        struct cleanup_list {
+            cleanup_list() : running(false) {}
+            ~cleanup_list();
+            bool running;
+            std::vector<impl::listen_impl_func<impl::H_STREAM>*> pending;
+        };
 
-        void intrusive_ptr_add_ref(sodium::impl::listen_impl_func<sodium::impl::H_NODE>* p)
+#if defined(SODIUM_SINGLE_THREADED)
+        static cleanup_list cleanups;
+        static bool cleanups_retired;  // The list has been destroyed
+#else
+        static thread_local cleanup_list cleanups;
+        static thread_local bool cleanups_retired;  // The list has been destroyed
+#endif
+
+        cleanup_list::~cleanup_list()
         {
-            spin_lock* l = spin_get_and_lock(p);
-            p->counts.inc_node();
-            l->unlock();
+            cleanups_retired = true;
         }
 
-        void intrusive_ptr_release(sodium::impl::listen_impl_func<sodium::impl::H_NODE>* p)
+        post_node* new_post_node()
         {
-            spin_lock* l = spin_get_and_lock(p);
-            p->counts.dec_node();
-            p->update_and_unlock(l);
+            if (post_nodes.nodes.empty())
+                return new post_node;
+            post_node* n = post_nodes.nodes.back();
+            post_nodes.nodes.pop_back();
+            return n;
         }
-        
-        void holder::handle(const std::shared_ptr<node>& target, transaction_impl* trans, const light_ptr& value) const
+
+        void free_post_node(post_node* n)
         {
-            if (handler)
-                (*handler)(target, trans, value);
+            if (post_nodes.nodes.size() < 64)
+                post_nodes.nodes.push_back(n);
             else
-                send(target, trans, value);
+                delete n;
         }
-
     }
 
     partition::partition()
         : depth(0),
           processing_post(false),
           processing_on_start_hooks(false),
-          shutting_down(false)
+          shutting_down(false),
+          spare(NULL),
+          pool(NULL),
+          parallel_min_width(0)
     {
     }
                             
@@ -85,15 +125,61 @@ namespace sodium {
     {
         shutting_down = true;
         on_start_hooks.clear();
+        while (impl::mpsc_node* n = postQ.pop())
+            delete static_cast<post_node*>(n);
+        delete spare;
+        delete pool;
     }
 
-    void partition::post(std::function<void()> action)
+    void partition::set_parallelism(unsigned threads, size_t min_width)
     {
         mx.lock();
-        postQ.push_back(std::move(action));
+        delete pool;
+        pool = threads > 1 ? new impl::worker_pool(threads) : NULL;
+        parallel_min_width = min_width > 2 ? min_width : 2;
         mx.unlock();
     }
 
+    /*!
+     * Get a context for a new top-level transaction. Must be called with mx held.
+     */
+    impl::transaction_impl* partition::new_transaction()
+    {
+        impl::transaction_impl* impl = spare;
+        if (impl != NULL) {
+            spare = NULL;
+            return impl;
+        }
+        else
+            return new impl::transaction_impl(this);
+    }
+
+    /*static*/ partition* partition::default_partition()
+    {
+        // Never destroyed, so that it can be used during static destruction.
+        static partition* part = new partition;
+        return part;
+    }
+
+    /*!
+     * Take back a finished top-level transaction's context. Must be called with mx held.
+     */
+    void partition::recycle(impl::transaction_impl* impl)
+    {
+        impl->reset();
+        if (spare == NULL)
+            spare = impl;
+        else
+            delete impl;
+    }
+
+    void partition::post(impl::small_action action)
+    {
+        post_node* n = new_post_node();
+        n->action = std::move(action);
+        postQ.push(n);
+    }
+
     void partition::on_start(std::function<void()> action)
     {
         mx.lock();
@@ -101,6 +187,9 @@ namespace sodium {
         mx.unlock();
     }
 
+    /*!
+     * Run posted actions. Called with mx held, which is released while the actions run.
+     */
     void partition::process_post()
     {
 #if !defined(SODIUM_SINGLE_THREADED)
@@ -109,24 +198,32 @@ namespace sodium {
         if (!processing_post) {
             processing_post = true;
 #endif
+            // Posting doesn't take mx, so it's only needed again to check that nothing
+            // more was posted before letting another thread take over.
+            while (!postQ.empty()) {
+                mx.unlock();
 #if !defined(SODIUM_NO_EXCEPTIONS)
-            try {
+                try {
 #endif
-                while (postQ.begin() != postQ.end()) {
-                    std::function<void()> action = *postQ.begin();
-                    postQ.erase(postQ.begin());
-                    mx.unlock();
-                    action();
+                    while (impl::mpsc_node* n = postQ.pop()) {
+                        post_node* pn = static_cast<post_node*>(n);
+                        impl::small_action action(std::move(pn->action));
+                        free_post_node(pn);
+                        SODIUM_STAT(posts_run++);
+                        action();
+                    }
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                }
+                catch (...) {
                     mx.lock();
+                    processing_post = false;
+                    mx.unlock();
+                    throw;
                 }
-                processing_post = false;
-#if !defined(SODIUM_NO_EXCEPTIONS)
-            }
-            catch (...) {
-                processing_post = false;
-                throw;
-            }
 #endif
+                mx.lock();
+            }
+            processing_post = false;
 #if !defined(SODIUM_SINGLE_THREADED)
         }
 #endif
@@ -134,88 +231,170 @@ namespace sodium {
 
     namespace impl {
 
-        node::node() : rank(0) {}
-        node::node(rank_t rank_) : rank(rank_) {}
-        node::~node()
+        void clean_up_later(listen_impl_func<H_STREAM>* p)
         {
-            for (std::forward_list<node::target>::iterator it = targets.begin(); it != targets.end(); it++) {
-                std::shared_ptr<node> targ = it->n;
-                if (targ) {
-                    boost::intrusive_ptr<listen_impl_func<H_STREAM> > li(
-                        reinterpret_cast<listen_impl_func<H_STREAM>*>(listen_impl.get()));
-                    targ->sources.remove(li);
+            if (cleanups_retired) {
+                p->clean_up();
+                return;
+            }
+            cleanup_list& cl = cleanups;
+            if (cl.running) {
+                cl.pending.push_back(p);
+                return;
+            }
+            cl.running = true;
+            try {
+                p->clean_up();
+                while (!cl.pending.empty()) {
+                    p = cl.pending.back();
+                    cl.pending.pop_back();
+                    p->clean_up();
                 }
             }
+            catch (...) {
+                cl.running = false;
+                throw;
+            }
+            cl.running = false;
+        }
+
+        node::node() : rank(0), free_handle(no_handle), dead_targets(0), visited(0) {}
+        node::node(rank_t rank_) : rank(rank_), free_handle(no_handle), dead_targets(0), visited(0) {}
+        node::~node()
+        {
+            if (listen_impl)
+                listen_impl->owner = NULL;
+            for (std::vector<node::target>::iterator it = targets.begin(); it != targets.end(); ++it)
+                if (it->handle != no_handle && it->n)
+                    it->n->remove_source(it->source_pos);
         }
 
-        bool node::link(void* holder, const std::shared_ptr<node>& targ)
+        size_t node::link(void* holder, const std::shared_ptr<node>& targ)
         {
-            bool changed;
+            if (targ)
+                targ->ensure_bigger_than(rank);
+            size_t handle;
+            if (free_handle != no_handle) {
+                handle = free_handle;
+                free_handle = handles[handle];
+            }
+            else {
+                handle = handles.size();
+                handles.push_back(0);
+            }
+            handles[handle] = targets.size();
+            targets.push_back(target(holder, targ, handle));
             if (targ) {
-                std::set<node*> visited;
-                changed = targ->ensure_bigger_than(visited, rank);
                 boost::intrusive_ptr<listen_impl_func<H_STREAM> > li(
                     reinterpret_cast<listen_impl_func<H_STREAM>*>(listen_impl.get()));
-                targ->sources.push_front(li);
+                targets.back().source_pos = targ->sources.size();
+                targ->sources.push_back(source(li, this, handle));
             }
-            else
-                changed = false;
-            targets.push_front(target(holder, targ));
-            return changed;
+            return handle;
         }
 
-        void node::unlink(void* holder)
+        void node::unlink(size_t handle)
         {
-            std::forward_list<node::target>::iterator this_it;
-            for (std::forward_list<node::target>::iterator last_it = targets.before_begin(); true; last_it = this_it) {
-                this_it = last_it;
-                ++this_it;
-                if (this_it == targets.end())
-                    break;
-                if (this_it->h == holder) {
-                    std::shared_ptr<node> targ = this_it->n;
-                    targets.erase_after(last_it);
-                    if (targ) {
-                        boost::intrusive_ptr<listen_impl_func<H_STREAM> > li(
-                            reinterpret_cast<listen_impl_func<H_STREAM>*>(listen_impl.get()));
-                        targ->sources.remove(li);
-                    }
-                    break;
-                }
+            node::target& t = targets[handles[handle]];
+            // Releasing these can run cleanups, so hold on to them until this node is
+            // consistent again.
+            std::shared_ptr<node> targ(std::move(t.n));
+            boost::intrusive_ptr<listen_impl_func<H_STREAM> > li;
+            if (targ)
+                li = targ->remove_source(t.source_pos);
+            t.h = NULL;
+            t.handle = no_handle;
+            handles[handle] = free_handle;
+            free_handle = handle;
+            if (++dead_targets > targets.size() / 2)
+                compact_targets();
+        }
+
+        /*!
+         * Remove an entry from sources by moving the last one into its place.
+         */
+        boost::intrusive_ptr<listen_impl_func<H_STREAM> > node::remove_source(size_t pos)
+        {
+            boost::intrusive_ptr<listen_impl_func<H_STREAM> > li(std::move(sources[pos].li));
+            if (pos + 1 != sources.size()) {
+                sources[pos] = std::move(sources.back());
+                node* from = sources[pos].from;
+                from->targets[from->handles[sources[pos].handle]].source_pos = pos;
             }
+            sources.pop_back();
+            return li;
         }
 
-        void node::unlink_by_target(const std::shared_ptr<node>& targ)
+        void node::compact_targets()
         {
-            std::forward_list<node::target>::iterator this_it;
-            for (std::forward_list<node::target>::iterator last_it = targets.before_begin(); true; last_it = this_it) {
-                this_it = last_it;
-                ++this_it;
-                if (this_it == targets.end())
-                    break;
-                if (this_it->n == targ) {
-                    targets.erase_after(last_it);
-                    if (targ) {
-                        boost::intrusive_ptr<listen_impl_func<H_STREAM> > li(
-                            reinterpret_cast<listen_impl_func<H_STREAM>*>(listen_impl.get()));
-                        targ->sources.remove(li);
-                    }
-                    break;
+            size_t j = 0;
+            for (size_t i = 0; i < targets.size(); i++)
+                if (targets[i].handle != no_handle) {
+                    if (i != j)
+                        targets[j] = std::move(targets[i]);
+                    handles[targets[j].handle] = j;
+                    j++;
                 }
-            }
+            targets.erase(targets.begin() + j, targets.end());
+            dead_targets = 0;
         }
 
-        bool node::ensure_bigger_than(std::set<node*>& visited, rank_t limit)
+        namespace {
+            // Each walk stamps the nodes it reaches with a new epoch, so there's no
+            // visited set to build. Nodes of different partitions can be linked at the
+            // same time, hence the atomic.
+            std::atomic<unsigned long> rank_epoch(0);
+
+            struct rank_step {
+                rank_step(node* n_, rank_t limit_) : n(n_), limit(limit_) {}
+                node* n;
+                rank_t limit;
+            };
+#if defined(SODIUM_SINGLE_THREADED)
+            std::vector<rank_step> rank_stack;
+#else
+            thread_local std::vector<rank_step> rank_stack;
+#endif
+        }
+
+        /*!
+         * Make this node's rank bigger than limit, and likewise down the graph. This
+         * walks depth-first using an explicit stack, so long chains can't overflow the
+         * call stack, and each node is re-ranked at most once per walk so that loops
+         * terminate.
+         *
+         * Ranks are spaced SODIUM_RANK_GAP apart. A node that has to move goes halfway
+         * into the gap below its lowest-ranked target if there is one, so its targets
+         * stay where they are. Only when the gap has closed up are they moved as well.
+         */
+        void node::ensure_bigger_than(rank_t limit)
         {
-            if (rank > limit || visited.find(this) != visited.end())
-                return false;
-            else {
-                visited.insert(this);
-                rank = limit + 1;
-                for (std::forward_list<node::target>::iterator it = targets.begin(); it != targets.end(); ++it)
+            if (rank > limit)
+                return;
+            unsigned long epoch = ++rank_epoch;
+            std::vector<rank_step>& stack(rank_stack);
+            stack.push_back(rank_step(this, limit));
+            while (!stack.empty()) {
+                rank_step step = stack.back();
+                stack.pop_back();
+                node* n = step.n;
+                if (n->rank > step.limit || n->visited == epoch)
+                    continue;
+                n->visited = epoch;
+                rank_t lowest = SODIUM_IMPL_RANK_T_MAX;
+                for (std::vector<node::target>::iterator it = n->targets.begin(); it != n->targets.end(); ++it)
+                    if (it->n && it->n->rank < lowest)
+                        lowest = it->n->rank;
+                rank_t room = lowest - step.limit;  // lowest > limit unless there's a loop
+                if (lowest > step.limit && room >= 2) {
+                    n->rank = step.limit + std::min<rank_t>(room / 2, SODIUM_RANK_GAP);
+                    continue;
+                }
+                n->rank = step.limit + SODIUM_RANK_GAP;
+                // Pushed oldest first so the newest target is walked first.
+                for (std::vector<node::target>::iterator it = n->targets.begin(); it != n->targets.end(); ++it)
                     if (it->n)
-                        it->n->ensure_bigger_than(visited, rank);
-                return true;
+                        stack.push_back(rank_step(it->n.get(), n->rank));
             }
         }
 
@@ -227,86 +406,432 @@ namespace sodium {
                 return SODIUM_IMPL_RANK_T_MAX;
         }
 
-        transaction_impl::transaction_impl()
-            : to_regen(false),
-              inCallback(0)
+        transaction_impl::transaction_impl(partition* part_)
+            : part(part_),
+              outer(NULL),
+              inCallback(0),
+              capturing(false)
         {
-            if (part == nullptr)
-                part = new partition;
         }
 
-        void transaction_impl::check_regen() {
-            if (to_regen) {
-                to_regen = false;
-                prioritizedQ.clear();
-                for (std::map<entryID, prioritized_entry>::iterator it = entries.begin(); it != entries.end(); ++it)
-                    prioritizedQ.insert(pair<rank_t, entryID>(rankOf(it->second.target), it->first));
+        transaction_impl::~transaction_impl()
+        {
+        }
+
+        /*!
+         * Discard anything left over (if processing threw) and make ready for reuse,
+         * keeping the memory.
+         */
+        void transaction_impl::reset()
+        {
+            prioritizedQ.clear();
+            lastQ.clear();
+            clear_fired();
+            next_entry_id = entryID();
+            inCallback = 0;
+            capturing = false;
+            SODIUM_STAT(stats = transaction_stats());
+            level.clear();
+            for (size_t i = 0; i < outputs.size(); i++) {
+                outputs[i].queued.clear();
+                outputs[i].lasts.clear();
+                while (outputs[i].fired) {
+                    std::shared_ptr<node> n(std::move(outputs[i].fired));
+                    outputs[i].fired = std::move(n->next_fired);
+                    n->firings.clear();
+                }
             }
         }
 
-        transaction_impl::~transaction_impl()
+        /*!
+         * Run a broadcast's targets, newest first. A target that has been re-ranked
+         * since it was sent gets an entry of its own under its new rank, with the id
+         * it would have had if it had been sent to separately.
+         */
+        void transaction_impl::run_broadcast(prioritized_entry& e, entryID id)
+        {
+            for (size_t i = e.slot; i-- > 0; ) {
+                const node::target& t = e.from->targets[i];
+                if (t.handle == node::no_handle)
+                    continue;
+                rank_t current = rankOf(t.n);
+                if (current != e.broadcast_rank) {
+                    SODIUM_STAT(stats.regens++);
+                    prioritizedQ.push(current, entryID(id.id + (e.slot - 1 - i)), prioritized_entry(e.from, i, e.firing));
+                    continue;
+                }
+                SODIUM_STAT(stats.prioritized++);
+                // The handler may link more targets to e.from, which can move t.
+                holder* h = (holder*)t.h;
+                std::shared_ptr<node> target(t.n);
+                inCallback++;
+                try {
+                    h->handle(target, this, e.value());
+                    inCallback--;
+                }
+                catch (...) {
+                    inCallback--;
+                    throw;
+                }
+            }
+        }
+
+        void transaction_impl::run_entry(prioritized_entry& e)
         {
+            SODIUM_STAT(stats.prioritized++);
+            if (e.from != NULL) {
+                inCallback++;
+                try {
+                    // The handler may link more targets to e.from, which can move dest().
+                    const node::target& t = e.dest();
+                    holder* h = (holder*)t.h;
+                    std::shared_ptr<node> target(t.n);
+                    h->handle(target, this, e.value());
+                    inCallback--;
+                }
+                catch (...) {
+                    inCallback--;
+                    throw;
+                }
+            }
+            else
+                e.action(this);
         }
 
         void transaction_impl::process_transactional()
         {
-            while (true) {
-                check_regen();
-                std::multiset<pair<rank_t, entryID>>::iterator pit = prioritizedQ.begin();
-                if (pit == prioritizedQ.end()) break;
-                std::map<entryID, prioritized_entry>::iterator eit = entries.find(pit->second);
-                assert(eit != entries.end());
-                std::function<void(transaction_impl*)> action = eit->second.action;
-                prioritizedQ.erase(pit);
-                entries.erase(eit);
-                action(this);
+            while (!prioritizedQ.empty()) {
+                rank_t rank = prioritizedQ.top_rank();
+                if (part->pool != NULL && rank != SODIUM_IMPL_RANK_T_MAX
+                        && prioritizedQ.top_width() >= part->parallel_min_width) {
+                    process_level(rank);
+                    continue;
+                }
+                entryID id;
+                prioritized_entry e(prioritizedQ.pop(id));
+                // node::link() only ever raises ranks, so if the target was re-ranked
+                // after this entry was queued, the entry is filed too early, never too
+                // late. Re-file it now under the target's current rank.
+                rank_t current = e.rank();
+                if (current != rank) {
+                    SODIUM_STAT(stats.regens++);
+                    prioritizedQ.push(current, id, std::move(e));
+                    continue;
+                }
+                SODIUM_STAT(if (rank != SODIUM_IMPL_RANK_T_MAX && rank > stats.max_rank) stats.max_rank = rank);
+                if (e.broadcast)
+                    run_broadcast(e, id);
+                else
+                    run_entry(e);
             }
-            while (lastQ.begin() != lastQ.end()) {
-                (*lastQ.begin())();
-                lastQ.erase(lastQ.begin());
+            // Dropping the fired nodes can free parts of the graph whose cleanups
+            // queue last actions, and last actions can send, so go round until
+            // both are empty. Actions may queue more actions, so take each one
+            // out before running it.
+            size_t i = 0;
+            do {
+                clear_fired();
+                for (; i < lastQ.size(); i++) {
+                    small_action action(std::move(lastQ[i]));
+                    action();
+                }
+            } while (fired);
+            SODIUM_STAT(stats.last_actions = lastQ.size());
+            lastQ.clear();
+        }
+
+        namespace {
+            struct by_target {
+                typedef std::pair<entryID, prioritized_entry> item;
+                bool operator () (const item& a, const item& b) const {
+                    return a.second.dest().n.get() < b.second.dest().n.get();
+                }
+            };
+            struct by_id {
+                template <typename T>
+                bool operator () (const std::pair<entryID, T>& a, const std::pair<entryID, T>& b) const {
+                    return a.first < b.first;
+                }
+            };
+            struct by_first_id {
+                by_first_id(const std::vector<std::pair<entryID, prioritized_entry>>& level_)
+                    : level(level_) {}
+                const std::vector<std::pair<entryID, prioritized_entry>>& level;
+                bool operator () (const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b) const {
+                    return level[a.first].first < level[b.first].first;
+                }
+            };
+        }
+
+        /*!
+         * Run all the entries of the lowest rank. Nodes of the same rank can't depend on
+         * each other, so if every entry is a handler that only sends to its own target,
+         * the handlers for different targets are run in parallel on the partition's pool.
+         * Each target's entries still run in order on one thread, and what they queue is
+         * added to the transaction in the order of the entries that queued it, as if the
+         * level had been run on one thread.
+         */
+        void transaction_impl::process_level(rank_t rank)
+        {
+            level.clear();
+            bool parallel = true;
+            SODIUM_STAT(if (rank > stats.max_rank) stats.max_rank = rank);
+            while (!prioritizedQ.empty() && prioritizedQ.top_rank() == rank) {
+                entryID id;
+                prioritized_entry e(prioritizedQ.pop(id));
+                rank_t current = e.rank();
+                if (current != rank) {
+                    SODIUM_STAT(stats.regens++);
+                    prioritizedQ.push(current, id, std::move(e));
+                    continue;
+                }
+                if (e.broadcast) {
+                    // Split it up, so its targets can be spread across threads.
+                    for (size_t i = e.slot; i-- > 0; ) {
+                        const node::target& t = e.from->targets[i];
+                        if (t.handle == node::no_handle)
+                            continue;
+                        entryID id1(id.id + (e.slot - 1 - i));
+                        prioritized_entry e1(e.from, i, e.firing);
+                        if (rankOf(t.n) != rank) {
+                            SODIUM_STAT(stats.regens++);
+                            prioritizedQ.push(rankOf(t.n), id1, std::move(e1));
+                            continue;
+                        }
+                        if (!((holder*)t.h)->is_parallel_safe())
+                            parallel = false;
+                        level.push_back(std::make_pair(id1, std::move(e1)));
+                    }
+                    continue;
+                }
+                if (e.from == NULL || !((holder*)e.dest().h)->is_parallel_safe())
+                    parallel = false;
+                level.push_back(std::make_pair(id, std::move(e)));
             }
+            groups.clear();
+            if (parallel && level.size() >= part->parallel_min_width) {
+                std::stable_sort(level.begin(), level.end(), by_target());
+                for (size_t i = 0; i < level.size(); ) {
+                    size_t j = i + 1;
+                    while (j < level.size() && level[j].second.dest().n == level[i].second.dest().n)
+                        j++;
+                    groups.push_back(std::make_pair(i, j));
+                    i = j;
+                }
+                std::sort(groups.begin(), groups.end(), by_first_id(level));
+            }
+            if (groups.size() < 2) {
+                if (!groups.empty())
+                    std::sort(level.begin(), level.end(), by_id());
+                // Handlers may re-rank nodes, so check each entry again before running it.
+                for (size_t i = 0; i < level.size(); i++) {
+                    prioritized_entry& e = level[i].second;
+                    rank_t current = e.rank();
+                    if (current != rank) {
+                        SODIUM_STAT(stats.regens++);
+                        prioritizedQ.push(current, level[i].first, std::move(e));
+                    }
+                    else
+                        run_entry(e);
+                }
+                level.clear();
+                return;
+            }
+
+            if (outputs.size() < groups.size())
+                outputs.resize(groups.size());
+            capturing = true;
+            inCallback++;
+            try {
+                part->pool->run(groups.size(), [this] (size_t g) {
+                    transaction_impl* prev = global_current_transaction;
+                    global_current_transaction = this;
+                    current_output = &outputs[g];
+                    try {
+                        for (size_t i = groups[g].first; i < groups[g].second; i++) {
+                            current_output->running = level[i].first;
+                            const prioritized_entry& e = level[i].second;
+                            const node::target& t = e.dest();
+                            ((holder*)t.h)->handle(t.n, this, e.value());
+                        }
+                    }
+                    catch (...) {
+                        current_output = NULL;
+                        global_current_transaction = prev;
+                        throw;
+                    }
+                    current_output = NULL;
+                    global_current_transaction = prev;
+                });
+            }
+            catch (...) {
+                capturing = false;
+                inCallback--;
+                level.clear();
+                throw;
+            }
+            capturing = false;
+            inCallback--;
+            SODIUM_STAT(stats.prioritized += level.size());
+            level.clear();
+
+            // Each entry's outputs are in order within its group, and each entry is in
+            // one group, so a stable sort on the entry ids puts them all back in the
+            // order they'd have been queued in without the pool.
+            for (size_t g = 0; g < groups.size(); g++) {
+                level_output& out = outputs[g];
+                for (size_t i = 0; i < out.queued.size(); i++)
+                    level.push_back(std::move(out.queued[i]));
+                for (size_t i = 0; i < out.lasts.size(); i++)
+                    level_lasts.push_back(std::move(out.lasts[i]));
+                while (out.fired) {
+                    std::shared_ptr<node> n(std::move(out.fired));
+                    out.fired = std::move(n->next_fired);
+                    n->next_fired = std::move(fired);
+                    fired = std::move(n);
+                }
+                out.queued.clear();
+                out.lasts.clear();
+            }
+            std::stable_sort(level.begin(), level.end(), by_id());
+            for (size_t i = 0; i < level.size(); i++)
+                prioritized(std::move(level[i].second));
+            level.clear();
+            std::stable_sort(level_lasts.begin(), level_lasts.end(), by_id());
+            for (size_t i = 0; i < level_lasts.size(); i++)
+                lastQ.push_back(std::move(level_lasts[i].second));
+            level_lasts.clear();
         }
 
         void transaction_impl::prioritized(std::shared_ptr<node> target,
-                                           std::function<void(transaction_impl*)> f)
+                                           prioritized_action f)
         {
+            if (capturing) {
+                current_output->queued.push_back(std::make_pair(current_output->running,
+                    prioritized_entry(std::move(target), std::move(f))));
+                return;
+            }
             entryID id = next_entry_id;
             next_entry_id = next_entry_id.succ();
-            entries.insert(pair<entryID, prioritized_entry>(id, prioritized_entry(target, std::move(f))));
-            prioritizedQ.insert(pair<rank_t, entryID>(rankOf(target), id));
+            rank_t rank = rankOf(target);
+            prioritizedQ.push(rank, id, prioritized_entry(std::move(target), std::move(f)));
+        }
+
+        void transaction_impl::prioritized(node* from, size_t firing)
+        {
+            const std::vector<node::target>& targets = from->targets;
+            size_t live = 0;
+            bool same = true;
+            rank_t rank = 0;
+            for (std::vector<node::target>::const_iterator it = targets.begin(); it != targets.end(); ++it) {
+                if (it->handle == node::no_handle)
+                    continue;
+                rank_t r = rankOf(it->n);
+                if (live++ == 0)
+                    rank = r;
+                else if (r != rank) {
+                    same = false;
+                    break;
+                }
+            }
+            if (live >= 2 && same)
+                prioritized(prioritized_entry(from, targets.size(), firing, rank));
+            else
+                // Newest target first
+                for (size_t i = targets.size(); i-- > 0; )
+                    if (targets[i].handle != node::no_handle)
+                        prioritized(prioritized_entry(from, i, firing));
+        }
+
+        void transaction_impl::prioritized(prioritized_entry e)
+        {
+            if (capturing) {
+                current_output->queued.push_back(std::make_pair(current_output->running, std::move(e)));
+                return;
+            }
+            // A broadcast takes an id for each target, which they keep if it's split up.
+            entryID id = next_entry_id;
+            next_entry_id = e.broadcast ? entryID(id.id + e.slot) : id.succ();
+            rank_t rank = e.rank();
+            prioritizedQ.push(rank, id, std::move(e));
+        }
+
+        void transaction_impl::add_fired(const std::shared_ptr<node>& n)
+        {
+            std::shared_ptr<node>& head = capturing ? current_output->fired : fired;
+            n->next_fired = std::move(head);
+            head = n;
         }
 
-        void transaction_impl::last(const std::function<void()>& action)
+        void transaction_impl::clear_fired()
         {
-            lastQ.push_back(action);
+            while (fired) {
+                std::shared_ptr<node> n(std::move(fired));
+                fired = std::move(n->next_fired);
+                n->firings.clear();
+                SODIUM_STAT(stats.fired_nodes++);
+            }
+        }
+
+        void transaction_impl::last(small_action action)
+        {
+            if (capturing) {
+                current_output->lasts.push_back(std::make_pair(current_output->running, std::move(action)));
+                return;
+            }
+            lastQ.push_back(std::move(action));
         }
 
         transaction_::transaction_()
-            : impl_(current_transaction())
+            : impl_(NULL)
+        {
+            open(NULL);
+        }
+
+        transaction_::transaction_(partition* part)
+            : impl_(NULL)
+        {
+            open(part);
+        }
+
+        void transaction_::open(partition* part)
         {
+            transaction_impl* cur = current_transaction();
+            if (part == NULL)
+                part = cur != NULL ? cur->part : partition::default_partition();
+            for (transaction_impl* t = cur; t != NULL; t = t->outer)
+                if (t->part == part) {
+                    impl_ = t;
+                    break;
+                }
             if (impl_ == NULL) {
-                if (transaction_impl::part == nullptr)
-                    transaction_impl::part = new partition;
-                transaction_impl::part->mx.lock();
-                if (!transaction_impl::part->processing_on_start_hooks) {
-                    transaction_impl::part->processing_on_start_hooks = true;
+                SODIUM_STAT(std::chrono::steady_clock::time_point waiting = std::chrono::steady_clock::now());
+                part->mx.lock();
+                if (!part->processing_on_start_hooks) {
+                    part->processing_on_start_hooks = true;
                     try {
-                        if (!transaction_impl::part->shutting_down) {
-                            for (auto it = transaction_impl::part->on_start_hooks.begin();
-                                   it != transaction_impl::part->on_start_hooks.end(); ++it)
+                        if (!part->shutting_down) {
+                            for (auto it = part->on_start_hooks.begin();
+                                   it != part->on_start_hooks.end(); ++it)
                                 (*it)();
                         }
-                        transaction_impl::part->processing_on_start_hooks = false;
+                        part->processing_on_start_hooks = false;
                     }
                     catch (...) {
-                        transaction_impl::part->processing_on_start_hooks = false;
+                        part->processing_on_start_hooks = false;
                         throw;
                     }
                 }
-                impl_ = new transaction_impl;
+                impl_ = part->new_transaction();
+                impl_->outer = cur;
+#if defined(SODIUM_INSTRUMENT)
+                impl_->started = std::chrono::steady_clock::now();
+                impl_->stats.lock_wait_ns =
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(impl_->started - waiting).count();
+#endif
                 global_current_transaction = impl_;
             }
-            transaction_impl::part->depth++;
+            part->depth++;
         }
         
         transaction_::~transaction_()
@@ -319,28 +844,55 @@ namespace sodium {
             return global_current_transaction;
         }
 
+        partition* current_partition()
+        {
+            return global_current_transaction != NULL ? global_current_transaction->part
+                                                      : partition::default_partition();
+        }
+
+        partition* graph_partition(partition* part)
+        {
+            assert(global_current_transaction == NULL || global_current_transaction->part == part);
+            return part;
+        }
+
         void transaction_::close()
         {
             impl::transaction_impl* impl__(this->impl_);
             if (impl__) {
                 this->impl_ = NULL;
-                partition* part = transaction_impl::part;
+                partition* part = impl__->part;
                 if (part->depth == 1) {
+#if defined(SODIUM_INSTRUMENT)
+                    transaction_stats stats;
+                    std::chrono::steady_clock::time_point started;
+#endif
                     try {
                         impl__->process_transactional();
                         part->depth--;
-                        global_current_transaction = NULL;
-                        delete impl__;
+                        global_current_transaction = impl__->outer;
+                        SODIUM_STAT(stats = impl__->stats);
+                        SODIUM_STAT(started = impl__->started);
+                        part->recycle(impl__);
                     }
                     catch (...) {
                         part->depth--;
-                        global_current_transaction = NULL;
-                        delete impl__;
+                        global_current_transaction = impl__->outer;
+                        part->recycle(impl__);
                         part->mx.unlock();
                         throw;
                     }
+                    SODIUM_STAT(size_t posts_before = posts_run);
                     part->process_post();
                     part->mx.unlock();
+#if defined(SODIUM_INSTRUMENT)
+                    if (part->stats_callback) {
+                        stats.posts = posts_run - posts_before;
+                        stats.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - started).count();
+                        part->stats_callback(stats);
+                    }
+#endif
                 }
                 else
                     part->depth--;
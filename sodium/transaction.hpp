@@ -13,33 +13,119 @@
 #include <sodium/lock_pool.hpp>
 #include <sodium/unit.hpp>
 #include <sodium/mutex.hpp>
+#include <sodium/rank_queue.hpp>
+#include <sodium/mpsc_queue.hpp>
+#include <sodium/pool.hpp>
+#include <sodium/small_action.hpp>
+#include <sodium/worker_pool.hpp>
 #include <boost/optional.hpp>
 #include <boost/intrusive_ptr.hpp>
-#include <map>
 #include <set>
 #include <list>
+#include <vector>
+#include <atomic>
 #include <memory>
 #include <forward_list>
 #include <tuple>
+#include <new>
+#include <type_traits>
+
+#if defined(SODIUM_INSTRUMENT)
+#include <chrono>
+#define SODIUM_STAT(x) x
+#else
+#define SODIUM_STAT(x)
+#endif
 
 namespace sodium {
 
     class transaction_impl;
+    namespace impl {
+        struct transaction_impl;
+    }
+
+#if defined(SODIUM_INSTRUMENT)
+    /*!
+     * What one top-level transaction cost. Only collected when the library is compiled
+     * with SODIUM_INSTRUMENT. See partition::set_stats_callback().
+     */
+    struct transaction_stats {
+        transaction_stats() : lock_wait_ns(0), wall_ns(0), prioritized(0), max_rank(0),
+                              regens(0), last_actions(0), fired_nodes(0), posts(0) {}
+        long long lock_wait_ns;  // Time spent waiting for the partition's lock
+        long long wall_ns;       // From getting the lock to finishing the posted actions
+        size_t prioritized;      // Prioritized entries that were run
+        unsigned long max_rank;  // Highest rank reached, not counting listeners
+        size_t regens;           // Entries re-filed because their node was re-ranked
+        size_t last_actions;     // Length of lastQ
+        size_t fired_nodes;      // Nodes whose firings were cleared at the end
+        size_t posts;            // Posted actions run after the transaction
+    };
+#endif
 
+    /*!
+     * An independent unit of FRP logic with its own lock. Transactions in different
+     * partitions can run in parallel, so unrelated graphs should be built in separate
+     * partitions. A graph belongs to the partition of the transaction it was constructed
+     * in (see transaction(partition*)), and it must only be used from transactions in
+     * that partition. Use sodium::cross() to pass values between partitions.
+     *
+     * A partition must outlive the graphs that were built in it.
+     */
     struct partition {
         partition();
         ~partition();
+
+        /*!
+         * The partition that's used when no partition is specified.
+         */
+        static partition* default_partition();
+
         sodium::recursive_mutex mx;
-        int depth;
+        std::atomic<int> depth;  // Atomic because handlers running on worker threads
+                                 // can open nested transactions
 
         bool processing_post;
-        std::list<std::function<void()>> postQ;
-        void post(std::function<void()> action);
+        impl::mpsc_queue postQ;  // Producers don't take mx
+        void post(impl::small_action action);
         void process_post();
         std::list<std::function<void()>> on_start_hooks;
         bool processing_on_start_hooks;
         void on_start(std::function<void()> action);
         bool shutting_down;
+
+        // The context of the last top-level transaction, kept so that the next one
+        // can reuse its containers' memory.
+        impl::transaction_impl* spare;
+        impl::transaction_impl* new_transaction();
+        void recycle(impl::transaction_impl* impl);
+
+        /*!
+         * Propagate wide levels of the graph on a pool of threads. 'threads' includes the
+         * thread running the transaction, so 0 or 1 (the default) turns this off. Only
+         * levels with at least 'min_width' entries are worth spreading over threads.
+         * Must not be called while this partition has a transaction open.
+         *
+         * Only nodes made by map(), filter(), filter_optional() and coalesce(), and
+         * plain pass-throughs, are run in parallel, so the functions given to those
+         * must be pure (as they should be anyway) and thread-safe. Levels containing
+         * anything else, and listeners, are run on the transaction's own thread. The
+         * results, and the order listeners are called in, are the same as without a
+         * pool.
+         */
+        void set_parallelism(unsigned threads, size_t min_width = 16);
+        impl::worker_pool* pool;
+        size_t parallel_min_width;
+
+#if defined(SODIUM_INSTRUMENT)
+        /*!
+         * Call f with the statistics for each top-level transaction in this partition,
+         * after it has finished and released the lock. Set it up before the partition
+         * is in use.
+         */
+        void set_stats_callback(std::function<void(const transaction_stats&)> f) { stats_callback = std::move(f); }
+        std::function<void(const transaction_stats&)> stats_callback;
+#endif
     };
 
     namespace impl {
@@ -51,15 +137,26 @@ namespace sodium {
         class holder;
 
         class node;
+        struct H_STREAM;
         template <typename Allocator>
-        struct listen_impl_func {
+        struct listen_impl_func;
+
+        /*!
+         * Clean p up, or if this thread is already cleaning a stream up, queue p to
+         * be done after it. Cleaning a stream up can release the streams it was made
+         * from, so this keeps a long chain of them from being freed recursively.
+         */
+        void clean_up_later(listen_impl_func<H_STREAM>* p);
+
+        template <typename Allocator>
+        struct listen_impl_func : pooled {
             typedef std::function<std::function<void()>*(
                 transaction_impl*,
                 const std::shared_ptr<impl::node>&,
                 const std::shared_ptr<holder>&,
                 bool)> closure;
             listen_impl_func(closure* func_)
-                : func(func_) {}
+                : func(func_), owner(NULL), input(NULL), part(NULL) {}
             ~listen_impl_func()
             {
                 assert(cleanups.begin() == cleanups.end() && func == NULL);
@@ -67,53 +164,109 @@ namespace sodium {
             count_set counts;
             closure* func;
             std::forward_list<std::function<void()>*> cleanups;
-            inline void update_and_unlock(spin_lock* l) {
-                if (func && !counts.active()) {
-                    counts.inc_strong();
-                    l->unlock();
-                    for (auto it = cleanups.begin(); it != cleanups.end(); ++it) {
-                        (**it)();
-                        delete *it;
-                    }
-                    cleanups.clear();
-                    delete func;
-                    func = NULL;
-                    l->lock();
-                    counts.dec_strong();
-                }
-                if (!counts.alive()) {
-                    l->unlock();
+            // For walking the graph: the node this stream listens to if it has one,
+            // otherwise (for a fused stage) the stream it listens to on its behalf.
+            node* owner;
+            listen_impl_func<H_STREAM>* input;
+            partition* part;  // The partition the stream belongs to
+            /*!
+             * Act on what dropping a reference did to the counts.
+             */
+            inline void released(count_set::transition t) {
+                if (t == count_set::clean_up)
+                    clean_up_later(reinterpret_cast<listen_impl_func<H_STREAM>*>(this));
+                else if (t == count_set::destroy)
                     delete this;
+            }
+            void clean_up() {
+                for (auto it = cleanups.begin(); it != cleanups.end(); ++it) {
+                    (**it)();
+                    delete *it;
                 }
-                else
-                    l->unlock();
+                cleanups.clear();
+                delete func;
+                func = NULL;
+                // Drop the strong reference the counts gave us for cleaning up.
+                released(counts.dec_strong());
             }
         };
 
-        class holder {
+        /*!
+         * The function of a stateless stage such as map or filter. stream<A> derives
+         * typed ones that hold the user's functor, so it can be inlined into apply().
+         */
+        struct stage_fn {
+            virtual ~stage_fn() {}
+            /*!
+             * Returns the output value, which is either 'in' or has been put in 'out',
+             * or NULL if there is none.
+             */
+            virtual const light_ptr* apply(const light_ptr& in, light_ptr& out) const = 0;
+        };
+
+        class holder : public pooled {
             public:
                 holder(
-                    std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>* handler_
-                ) : handler(handler_) {}
+                    std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>* handler_,
+                    bool parallel_safe_ = false
+                ) : handler(handler_), parallel_safe(parallel_safe_ || handler_ == NULL) {}
+                /*!
+                 * A holder that passes values through a stage on their way to 'next'.
+                 */
+                holder(
+                    const std::shared_ptr<const stage_fn>& stage_,
+                    const std::shared_ptr<holder>& next_
+                ) : handler(NULL), stage(stage_), next(next_), parallel_safe(next_->parallel_safe) {}
                 ~holder() {
                     delete handler;
                 }
                 void handle(const std::shared_ptr<node>& target, transaction_impl* trans, const light_ptr& value) const;
+                /*!
+                 * True if the handler only sends to its own target, so it can run on a
+                 * worker thread alongside handlers for other nodes.
+                 */
+                bool is_parallel_safe() const { return parallel_safe; }
 
             private:
                 std::function<void(const std::shared_ptr<impl::node>&, transaction_impl*, const light_ptr&)>* handler;
+                std::shared_ptr<const stage_fn> stage;
+                std::shared_ptr<holder> next;
+                bool parallel_safe;
         };
 
         struct H_STREAM {};
         struct H_STRONG {};
         struct H_NODE {};
 
-        void intrusive_ptr_add_ref(sodium::impl::listen_impl_func<sodium::impl::H_STREAM>* p);
-        void intrusive_ptr_release(sodium::impl::listen_impl_func<sodium::impl::H_STREAM>* p);
-        void intrusive_ptr_add_ref(sodium::impl::listen_impl_func<sodium::impl::H_STRONG>* p);
-        void intrusive_ptr_release(sodium::impl::listen_impl_func<sodium::impl::H_STRONG>* p);
-        void intrusive_ptr_add_ref(sodium::impl::listen_impl_func<sodium::impl::H_NODE>* p);
-        void intrusive_ptr_release(sodium::impl::listen_impl_func<sodium::impl::H_NODE>* p);
+        inline void intrusive_ptr_add_ref(sodium::impl::listen_impl_func<sodium::impl::H_STREAM>* p)
+        {
+            p->counts.inc_stream();
+        }
+
+        inline void intrusive_ptr_release(sodium::impl::listen_impl_func<sodium::impl::H_STREAM>* p)
+        {
+            p->released(p->counts.dec_stream());
+        }
+
+        inline void intrusive_ptr_add_ref(sodium::impl::listen_impl_func<sodium::impl::H_STRONG>* p)
+        {
+            p->counts.inc_strong();
+        }
+
+        inline void intrusive_ptr_release(sodium::impl::listen_impl_func<sodium::impl::H_STRONG>* p)
+        {
+            p->released(p->counts.dec_strong());
+        }
+
+        inline void intrusive_ptr_add_ref(sodium::impl::listen_impl_func<sodium::impl::H_NODE>* p)
+        {
+            p->counts.inc_node();
+        }
+
+        inline void intrusive_ptr_release(sodium::impl::listen_impl_func<sodium::impl::H_NODE>* p)
+        {
+            p->released(p->counts.dec_node());
+        }
 
         inline bool alive(const boost::intrusive_ptr<listen_impl_func<H_STRONG> >& li) {
             return li && li->func != NULL;
@@ -123,18 +276,81 @@ namespace sodium {
             return li && li->func != NULL;
         }
 
-        class node
+        /*!
+         * The values a node has been sent in the current transaction, oldest first.
+         * Nodes rarely fire more than once per transaction, so the first value is
+         * stored inline. The rest keep their capacity when the list is cleared.
+         */
+        class firing_list {
+            public:
+                firing_list() : n(0) {}
+                ~firing_list() { clear(); }
+
+                bool empty() const { return n == 0; }
+                size_t size() const { return n; }
+                const light_ptr& operator [] (size_t i) const {
+                    return i == 0 ? *reinterpret_cast<const light_ptr*>(&first) : rest[i - 1];
+                }
+
+                void push_back(const light_ptr& a) {
+                    if (n == 0)
+                        new (&first) light_ptr(a);
+                    else
+                        rest.push_back(a);
+                    n++;
+                }
+
+                void clear() {
+                    if (n != 0) {
+                        reinterpret_cast<light_ptr*>(&first)->~light_ptr();
+                        rest.clear();
+                        n = 0;
+                    }
+                }
+
+            private:
+                // Disallow copying
+                firing_list(const firing_list&) {}
+                firing_list& operator = (const firing_list&) { return *this; }
+
+                size_t n;
+                std::aligned_storage<sizeof(light_ptr), std::alignment_of<light_ptr>::value>::type first;
+                std::vector<light_ptr> rest;
+        };
+
+        class node : public pooled
         {
             public:
+                static const size_t no_handle = (size_t)-1;
+
                 struct target {
                     target(
                         void* h_,
-                        const std::shared_ptr<node>& n_
+                        const std::shared_ptr<node>& n_,
+                        size_t handle_
                     ) : h(h_),
-                        n(n_) {}
+                        n(n_),
+                        handle(handle_),
+                        source_pos(0) {}
 
                     void* h;
                     std::shared_ptr<node> n;
+                    size_t handle;      // The handle link() returned, or no_handle once unlinked
+                    size_t source_pos;  // Where this link's entry is in n->sources
+                };
+
+                struct source {
+                    source(
+                        const boost::intrusive_ptr<listen_impl_func<H_STREAM> >& li_,
+                        node* from_,
+                        size_t handle_
+                    ) : li(li_),
+                        from(from_),
+                        handle(handle_) {}
+
+                    boost::intrusive_ptr<listen_impl_func<H_STREAM> > li;
+                    node* from;     // The node that links to this one
+                    size_t handle;  // from's handle for the link
                 };
 
             public:
@@ -143,17 +359,37 @@ namespace sodium {
                 ~node();
 
                 rank_t rank;
-                std::forward_list<node::target> targets;
-                std::forward_list<light_ptr> firings;
-                std::forward_list<boost::intrusive_ptr<listen_impl_func<H_STREAM> > > sources;
+                // Targets in the order they were linked. Unlinked targets are left in
+                // place (with handle == no_handle) until enough of them build up to be
+                // worth compacting, so indices of live targets are stable while a
+                // transaction is sending to them.
+                std::vector<node::target> targets;
+                std::vector<node::source> sources;  // Unordered
+                firing_list firings;
+                std::shared_ptr<node> next_fired;  // Links the transaction's list of nodes
+                                                   // that have firings to clear
                 boost::intrusive_ptr<listen_impl_func<H_NODE> > listen_impl;
 
-                bool link(void* holder, const std::shared_ptr<node>& target);
-                void unlink(void* holder);
-                void unlink_by_target(const std::shared_ptr<node>& target);
+                /*!
+                 * Link to a target, returning a handle for unlink().
+                 */
+                size_t link(void* holder, const std::shared_ptr<node>& target);
+                /*!
+                 * Remove a link. Only call this when the node isn't part of a transaction
+                 * that's still sending, e.g. from transaction_impl::last().
+                 */
+                void unlink(size_t handle);
 
             private:
-                bool ensure_bigger_than(std::set<node*>& visited, rank_t limit);
+                std::vector<size_t> handles;  // Handle -> index in targets. Free handles are
+                                              // chained through it, starting at free_handle.
+                size_t free_handle;
+                size_t dead_targets;
+                unsigned long visited;  // Epoch of the last re-ranking walk that reached this node
+
+                boost::intrusive_ptr<listen_impl_func<H_STREAM> > remove_source(size_t pos);
+                void compact_targets();
+                void ensure_bigger_than(rank_t limit);
         };
     }
 }
@@ -178,33 +414,109 @@ namespace sodium {
 
         rank_t rankOf(const std::shared_ptr<node>& target);
 
+        typedef basic_small_action<transaction_impl*> prioritized_action;
+
+        /*!
+         * A scheduled action. Either a send to one of a node's targets, which is
+         * stored inline and needs no allocation, or a general action, which is also
+         * stored inline if it's small enough.
+         */
         struct prioritized_entry {
             prioritized_entry(std::shared_ptr<node> target_,
-                              std::function<void(transaction_impl*)> action_)
-                : target(std::move(target_)), action(std::move(action_))
+                              prioritized_action action_)
+                : from(NULL), slot(0), firing(0), broadcast(false), broadcast_rank(0),
+                  target(std::move(target_)), action(std::move(action_))
+            {
+            }
+            prioritized_entry(node* from_, size_t slot_, size_t firing_)
+                : from(from_), slot(slot_), firing(firing_), broadcast(false), broadcast_rank(0)
             {
             }
+            /*!
+             * Send a firing to all of from's first 'end' targets, which all had rank 'rank'.
+             */
+            prioritized_entry(node* from_, size_t end_, size_t firing_, rank_t rank_)
+                : from(from_), slot(end_), firing(firing_), broadcast(true), broadcast_rank(rank_)
+            {
+            }
+            node* from;          // The sending node, or NULL for a general action. The
+                                 // transaction's fired list keeps it alive
+            size_t slot;         // Index in from->targets, or for a broadcast, the number of
+                                 // targets when it was sent
+            size_t firing;       // Index in from->firings of the value being sent
+            bool broadcast;
+            rank_t broadcast_rank;
             std::shared_ptr<node> target;
-            std::function<void(transaction_impl*)> action;
+            prioritized_action action;
+
+            const node::target& dest() const { return from->targets[slot]; }
+            const light_ptr& value() const { return from->firings[firing]; }
+            rank_t rank() const {
+                return broadcast ? broadcast_rank : rankOf(from != NULL ? dest().n : target);
+            }
+        };
+
+        /*!
+         * How many handlers an entry stands for.
+         */
+        struct entry_width {
+            size_t operator () (const prioritized_entry& e) const { return e.broadcast ? e.slot : 1; }
         };
 
         struct transaction_impl {
-            transaction_impl();
+            transaction_impl(partition* part);
             ~transaction_impl();
-            static partition* part;
+            partition* part;
+            transaction_impl* outer;  // Transaction that was open on this thread, in another
+                                      // partition, when this one began
             entryID next_entry_id;
-            std::map<entryID, prioritized_entry> entries;
-            std::multiset<std::pair<rank_t, entryID>> prioritizedQ;
-            std::list<std::function<void()>> lastQ;
-            bool to_regen;
+            rank_queue<rank_t, entryID, prioritized_entry, entry_width> prioritizedQ;
+            std::vector<small_action> lastQ;  // Keeps its capacity between transactions
+            std::shared_ptr<node> fired;      // Nodes to clear the firings of at the end,
+                                              // linked through node::next_fired
             int inCallback;
 
+            /*!
+             * What the handlers for one node queued while a level was being run in
+             * parallel, each with the id of the entry whose handler queued it. It's
+             * added to the transaction once the level is finished.
+             */
+            struct level_output {
+                std::vector<std::pair<entryID, prioritized_entry>> queued;
+                std::vector<std::pair<entryID, small_action>> lasts;
+                std::shared_ptr<node> fired;
+                entryID running;  // The entry whose handler is running
+            };
+#if defined(SODIUM_INSTRUMENT)
+            transaction_stats stats;
+            std::chrono::steady_clock::time_point started;
+#endif
+            bool capturing;  // Handlers are running on worker threads
+            std::vector<std::pair<entryID, prioritized_entry>> level;
+            std::vector<std::pair<size_t, size_t>> groups;  // Ranges of 'level' with the same target
+            std::vector<level_output> outputs;
+            std::vector<std::pair<entryID, small_action>> level_lasts;  // For putting outputs' last actions in order
+
             void prioritized(std::shared_ptr<impl::node> target,
-                             std::function<void(impl::transaction_impl*)> action);
-            void last(const std::function<void()>& action);
+                             prioritized_action action);
+            /*!
+             * Queue from->firings[firing] to be sent to all of from's targets. If they
+             * all have the same rank, as listeners do, this is a single entry.
+             */
+            void prioritized(node* from, size_t firing);
+            void prioritized(prioritized_entry e);
+            void last(small_action action);
+            /*!
+             * Add n to the nodes whose firings are cleared at the end of the transaction.
+             */
+            void add_fired(const std::shared_ptr<node>& n);
+            void clear_fired();
 
-            void check_regen();
             void process_transactional();
+            void process_level(rank_t rank);
+            void run_entry(prioritized_entry& e);
+            void run_broadcast(prioritized_entry& e, entryID id);
+            void reset();
         };
 
         class transaction_ {
@@ -212,14 +524,29 @@ namespace sodium {
             transaction_impl* impl_;
             transaction_(const transaction_&) {}
             transaction_& operator = (const transaction_&) { return *this; };
+            void open(partition* part);
         public:
             transaction_();
+            transaction_(partition* part);
             ~transaction_();
             impl::transaction_impl* impl() const { return impl_; }
         protected:
             void close();
             static transaction_impl* current_transaction();
         };
+
+        /*!
+         * The partition of the innermost transaction open on this thread, or the
+         * default partition if there isn't one.
+         */
+        partition* current_partition();
+
+        /*!
+         * The partition to open a transaction in to work on a graph belonging to
+         * 'part', which is 'part' itself. A transaction already open on this thread
+         * must be in that partition.
+         */
+        partition* graph_partition(partition* part);
     };
 
     class transaction : public impl::transaction_
@@ -231,6 +558,15 @@ namespace sodium {
             transaction& operator = (const transaction&) { return *this; };
         public:
             transaction() {}
+            /*!
+             * Open a transaction in the specified partition. If this thread already
+             * has a transaction open in that partition, this joins it. Otherwise it waits
+             * for the partition's lock.
+             *
+             * Avoid opening a transaction in one partition while holding one in another:
+             * if another thread does the reverse, they will deadlock.
+             */
+            explicit transaction(partition* part) : impl::transaction_(part) {}
             /*!
              * The destructor will close the transaction, so normally close() isn't needed.
              * But, in some cases you might want to close it earlier, and close() will do this for you.
@@ -0,0 +1,114 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#include <sodium/worker_pool.hpp>
+
+namespace sodium {
+    namespace impl {
+
+#if !defined(SODIUM_SINGLE_THREADED)
+
+        worker_pool::worker_pool(unsigned threads_)
+            : body(NULL),
+              n(0),
+              next(0),
+              generation(0),
+              busy(0),
+              stopping(false)
+        {
+            for (unsigned i = 1; i < threads_; i++)
+                threads.push_back(std::thread([this] () { work_loop(); }));
+        }
+
+        worker_pool::~worker_pool()
+        {
+            {
+                std::unique_lock<std::mutex> lock(mx);
+                stopping = true;
+            }
+            start_cv.notify_all();
+            for (auto it = threads.begin(); it != threads.end(); ++it)
+                it->join();
+        }
+
+        void worker_pool::run(size_t n_, const std::function<void(size_t)>& body_)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mx);
+                body = &body_;
+                n = n_;
+                next = 0;
+                error = std::exception_ptr();
+                busy = threads.size();
+                generation++;
+            }
+            start_cv.notify_all();
+            work();
+            std::unique_lock<std::mutex> lock(mx);
+            while (busy != 0)
+                done_cv.wait(lock);
+            body = NULL;
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        void worker_pool::work()
+        {
+            size_t i;
+            while ((i = next++) < n) {
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                try {
+#endif
+                    (*body)(i);
+#if !defined(SODIUM_NO_EXCEPTIONS)
+                }
+                catch (...) {
+                    std::unique_lock<std::mutex> lock(mx);
+                    if (!error)
+                        error = std::current_exception();
+                }
+#endif
+            }
+        }
+
+        void worker_pool::work_loop()
+        {
+            unsigned seen = 0;
+            std::unique_lock<std::mutex> lock(mx);
+            while (true) {
+                while (!stopping && generation == seen)
+                    start_cv.wait(lock);
+                if (stopping)
+                    return;
+                seen = generation;
+                lock.unlock();
+                work();
+                lock.lock();
+                if (--busy == 0)
+                    done_cv.notify_one();
+            }
+        }
+
+#else
+
+        worker_pool::worker_pool(unsigned threads_)
+        {
+        }
+
+        worker_pool::~worker_pool()
+        {
+        }
+
+        void worker_pool::run(size_t n, const std::function<void(size_t)>& body)
+        {
+            for (size_t i = 0; i < n; i++)
+                body(i);
+        }
+
+#endif
+
+    }
+}
@@ -0,0 +1,69 @@
+/**
+ * Copyright (c) 2012-2014, Stephen Blackheath and Anthony Jones
+ * Released under a BSD3 licence.
+ *
+ * C++ implementation courtesy of International Telematics Ltd.
+ */
+#ifndef _SODIUM_WORKER_POOL_HPP_
+#define _SODIUM_WORKER_POOL_HPP_
+
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <stddef.h>
+#if !defined(SODIUM_SINGLE_THREADED)
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#endif
+
+namespace sodium {
+    namespace impl {
+
+        /*!
+         * A fixed set of threads for running the tasks of a parallel loop. The thread
+         * that calls run() works on the loop too, and idle threads take the next
+         * unstarted task, so uneven tasks still balance across the threads.
+         */
+        class worker_pool {
+            public:
+                /*!
+                 * 'threads' includes the calling thread, so worker_pool(1) starts no threads.
+                 */
+                worker_pool(unsigned threads);
+                ~worker_pool();
+
+                /*!
+                 * Call body(i) for every i in [0, n) and wait for them all to finish.
+                 * If any of them throws, the first exception is rethrown here once
+                 * they have all finished.
+                 */
+                void run(size_t n, const std::function<void(size_t)>& body);
+
+            private:
+                // Disallow copying
+                worker_pool(const worker_pool&) {}
+                worker_pool& operator = (const worker_pool&) { return *this; }
+
+#if !defined(SODIUM_SINGLE_THREADED)
+                void work();
+                void work_loop();
+
+                std::vector<std::thread> threads;
+                std::mutex mx;
+                std::condition_variable start_cv;
+                std::condition_variable done_cv;
+                const std::function<void(size_t)>* body;
+                size_t n;
+                std::atomic<size_t> next;
+                unsigned generation;  // Bumped for each run()
+                unsigned busy;        // Workers still in the current run()
+                bool stopping;
+                std::exception_ptr error;
+#endif
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,67 @@
+/**
+ * Times building and tearing down a large graph: a fan-out of mapped, merged and
+ * held streams off one sink, each with a listener. Build with and without
+ * SODIUM_POOL_ALLOCATOR to compare.
+ *
+ * Run with
+ * bench/graph-build [size]
+ */
+#include <sodium/sodium.hpp>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace sodium;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    return d.count();
+}
+
+int main(int argc, char* argv[])
+{
+    int size = argc >= 2 ? atoi(argv[1]) : 200000;
+    for (int round = 0; round < 3; round++) {
+        stream_sink<int> s;
+        std::vector<cell<int>> cells;
+        std::vector<std::function<void()>> unlistens;
+        cells.reserve(size);
+        unlistens.reserve(size);
+        long total = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            transaction trans;
+            for (int i = 0; i < size; i++) {
+                stream<int> sa = s.map([i] (const int& x) { return x + i; });
+                cells.push_back(sa.or_else(s.filter([] (const int& x) { return x < 0; })).hold(0));
+                unlistens.push_back(cells.back().listen([&total] (const int& x) { total += x; }));
+            }
+            trans.close();
+        }
+        double build = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        s.send(1);
+        double send = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < unlistens.size(); i++)
+            unlistens[i]();
+        unlistens.clear();
+        cells.clear();
+        double teardown = seconds_since(start);
+
+        printf("%d streams: build %.3f ms (%.0f/s), send %.3f ms, teardown %.3f ms (%.0f/s)\n",
+            size,
+            build * 1000.0, size / build,
+            send * 1000.0,
+            teardown * 1000.0, size / teardown);
+        if (total == 0)
+            printf("(no values)\n");
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+/**
+ * Compares the throughput of stream_sink and ingest_sink when many threads send
+ * into the same partition.
+ *
+ * Run with
+ * bench/ingest-throughput [sends-per-thread]
+ */
+#include <sodium/sodium.hpp>
+#include <sodium/ingest.hpp>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace sodium;
+
+static double run(int threads, int sends, const std::function<void(int)>& send)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> ts;
+    for (int t = 0; t < threads; t++)
+        ts.push_back(std::thread([&send, sends] () {
+            for (int i = 0; i < sends; i++)
+                send(1);
+        }));
+    for (auto it = ts.begin(); it != ts.end(); ++it)
+        it->join();
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    return threads * (double)sends / secs.count();
+}
+
+int main(int argc, char* argv[])
+{
+    int sends = argc >= 2 ? atoi(argv[1]) : 100000;
+    printf("%8s %16s %16s %16s\n", "threads", "stream_sink/s", "ingest/s", "ingest(64)/s");
+    for (int threads = 1; threads <= 16; threads *= 2) {
+        std::atomic<long> total(0);
+        auto add = [&total] (const int& x) { total += x; };
+        auto sum = [] (const int& a, const int& b) { return a + b; };
+
+        stream_sink<int> s1(sum);
+        auto kill1 = s1.listen(add);
+        double r1 = run(threads, sends, [&s1] (int x) { s1.send(x); });
+        kill1();
+
+        ingest_sink<int> s2(sum);
+        auto kill2 = s2.listen(add);
+        double r2 = run(threads, sends, [&s2] (int x) { s2.send(x); });
+        kill2();
+
+        ingest_sink<int> s3(sum, 64);
+        auto kill3 = s3.listen(add);
+        double r3 = run(threads, sends, [&s3] (int x) { s3.send(x); });
+        kill3();
+
+        if (total != 3L * threads * sends) {
+            std::cerr << "lost values: " << total << std::endl;
+            return 1;
+        }
+        printf("%8d %16.0f %16.0f %16.0f\n", threads, r1, r2, r3);
+    }
+    return 0;
+}
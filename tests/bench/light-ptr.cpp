@@ -0,0 +1,95 @@
+/**
+ * Times copying and destroying light_ptrs on several threads at once, against
+ * the previous scheme of counting references under a lock_pool stripe. Each
+ * thread either works on a value of its own, or all threads share one value.
+ * The value is a string, since small values such as ints have no count.
+ *
+ * Run with
+ * bench/light-ptr [max threads] [copies per thread]
+ */
+#include <sodium/light_ptr.hpp>
+#include <sodium/lock_pool.hpp>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace sodium;
+
+/*!
+ * Reference counting the way light_ptr used to do it.
+ */
+struct locked_ptr {
+    locked_ptr(void* value_, int* count_) : value(value_), count(count_) {}
+    locked_ptr(const locked_ptr& other) : value(other.value), count(other.count) {
+        impl::spin_lock* l = impl::spin_get_and_lock(value);
+        (*count)++;
+        l->unlock();
+    }
+    ~locked_ptr() {
+        impl::spin_lock* l = impl::spin_get_and_lock(value);
+        --(*count);
+        l->unlock();
+    }
+    void* value;
+    int* count;
+};
+
+template <typename P>
+static void copy_loop(const P& p, long copies)
+{
+    for (long i = 0; i < copies; i++) {
+        P q(p);
+        P r(q);
+    }
+}
+
+template <typename P, typename Make>
+static double run(int threads, bool shared, long copies, Make make)
+{
+    std::vector<P> ps;
+    for (int i = 0; i < threads; i++)
+        ps.push_back(shared && i != 0 ? ps[0] : make());
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> ts;
+    for (int i = 0; i < threads; i++) {
+        const P& p = ps[i];
+        ts.push_back(std::thread([&p, copies] () { copy_loop(p, copies); }));
+    }
+    for (size_t i = 0; i < ts.size(); i++)
+        ts[i].join();
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    // Two copies and two destructions per iteration
+    return threads * copies * 4 / d.count() / 1e6;
+}
+
+int main(int argc, char* argv[])
+{
+    int max_threads = argc >= 2 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+    long copies = argc >= 3 ? atol(argv[2]) : 5000000;
+    if (max_threads < 1)
+        max_threads = 1;
+    std::vector<int> counts(max_threads, 1);
+    std::vector<int> values(max_threads);
+    printf("M ops/s (copy or destroy)  atomic own  atomic shared  locked own  locked shared\n");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        int next;
+        double a_own = run<light_ptr>(threads, false, copies, [] () { return light_ptr::create<std::string>(std::string()); });
+        double a_shared = run<light_ptr>(threads, true, copies, [] () { return light_ptr::create<std::string>(std::string()); });
+        next = 0;
+        double l_own = run<locked_ptr>(threads, false, copies, [&] () {
+            next++;
+            return locked_ptr(&values[next - 1], &counts[next - 1]);
+        });
+        next = 0;
+        double l_shared = run<locked_ptr>(threads, true, copies, [&] () {
+            next++;
+            return locked_ptr(&values[next - 1], &counts[next - 1]);
+        });
+        printf("%2d threads                 %10.1f  %13.1f  %10.1f  %13.1f\n",
+            threads, a_own, a_shared, l_own, l_shared);
+    }
+    return 0;
+}
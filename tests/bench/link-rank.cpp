@@ -0,0 +1,68 @@
+/**
+ * Times linking into graphs where the link forces everything downstream to be
+ * re-ranked: a deep chain of nodes and a wide fan-out of nodes, each hanging off
+ * a stream_loop that is then looped to a stream of a higher rank, with a listener
+ * on the end of each. The steps are accum_s() rather than map(), since maps
+ * are fused and get no nodes of their own to re-rank.
+ *
+ * Run with
+ * bench/link-rank [size]
+ */
+#include <sodium/sodium.hpp>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace sodium;
+
+static stream<int> step(const stream<int>& sa)
+{
+    return sa.accum_s<int>(0, [] (const int& x, const int&) { return x; });
+}
+
+static double time_loop(int size, bool deep)
+{
+    stream_sink<int> s;
+    std::vector<std::function<void()>> kills;
+    long total = 0;
+    double secs;
+    {
+        transaction trans;
+        stream_loop<int> l;
+        stream<int> sa = l;
+        for (int i = 0; i < size; i++) {
+            if (deep)
+                sa = step(sa);
+            else
+                kills.push_back(step(sa).listen([&total] (const int& x) { total += x; }));
+        }
+        if (deep)
+            kills.push_back(sa.listen([&total] (const int& x) { total += x; }));
+        // Give the looped-in stream a high rank so that the whole graph hanging off
+        // the loop has to be moved up.
+        stream<int> up = s;
+        for (int i = 0; i < 100; i++)
+            up = up.map([] (const int& x) { return x; });
+        auto start = std::chrono::steady_clock::now();
+        l.loop(up);
+        std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+        secs = d.count();
+        trans.close();
+    }
+    s.send(1);
+    for (size_t i = 0; i < kills.size(); i++)
+        kills[i]();
+    if (total != (deep ? 1 : size))
+        printf("wrong total %ld\n", total);
+    return secs;
+}
+
+int main(int argc, char* argv[])
+{
+    int size = argc >= 2 ? atoi(argv[1]) : 100000;
+    printf("deep chain of %d: %.3f ms\n", size, time_loop(size, true) * 1000.0);
+    printf("fan-out of %d:    %.3f ms\n", size, time_loop(size, false) * 1000.0);
+    return 0;
+}
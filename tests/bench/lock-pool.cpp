@@ -0,0 +1,94 @@
+/**
+ * Times taking and releasing lock_pool locks on several threads at once,
+ * against the previous pool of std::mutexes packed next to each other. Each
+ * thread either locks addresses of its own, or all threads lock the same one.
+ * Try it with different -DSODIUM_LOCK_POOL_BITS.
+ *
+ * Run with
+ * bench/lock-pool [max threads] [locks per thread]
+ */
+#include <sodium/lock_pool.hpp>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace sodium;
+
+/*!
+ * The lock pool the way it used to be.
+ */
+static std::mutex mutex_pool[1<<SODIUM_IMPL_LOCK_POOL_BITS];
+
+static std::mutex* mutex_get_and_lock(void* addr)
+{
+    std::mutex* m = &mutex_pool[(uint32_t)((uint32_t)
+        (uintptr_t)(addr)
+        * (uint32_t)2654435761U) >> (32 - SODIUM_IMPL_LOCK_POOL_BITS)];
+    m->lock();
+    return m;
+}
+
+struct spin_pool {
+    static void lock_unlock(void* addr, long* counter) {
+        impl::spin_lock* l = impl::spin_get_and_lock(addr);
+        (*counter)++;
+        l->unlock();
+    }
+};
+
+struct packed_mutexes {
+    static void lock_unlock(void* addr, long* counter) {
+        std::mutex* m = mutex_get_and_lock(addr);
+        (*counter)++;
+        m->unlock();
+    }
+};
+
+/*!
+ * Objects to lock, spaced out like heap objects would be.
+ */
+struct object {
+    long counter;
+    char padding[56];
+};
+
+template <typename Pool>
+static double run(int threads, bool shared, long locks)
+{
+    std::vector<object> objects(threads * 8);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> ts;
+    for (int i = 0; i < threads; i++) {
+        object* mine = shared ? &objects[0] : &objects[i * 8];
+        ts.push_back(std::thread([mine, locks] () {
+            for (long j = 0; j < locks; j++)
+                Pool::lock_unlock(mine, &mine->counter);
+        }));
+    }
+    for (size_t i = 0; i < ts.size(); i++)
+        ts[i].join();
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    return threads * locks / d.count() / 1e6;
+}
+
+int main(int argc, char* argv[])
+{
+    int max_threads = argc >= 2 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+    long locks = argc >= 3 ? atol(argv[2]) : 2000000;
+    if (max_threads < 1)
+        max_threads = 1;
+    printf("%d stripes\n", 1<<SODIUM_IMPL_LOCK_POOL_BITS);
+    printf("M locks/s                  spin own  spin shared  mutex own  mutex shared\n");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double s_own = run<spin_pool>(threads, false, locks);
+        double s_shared = run<spin_pool>(threads, true, locks);
+        double m_own = run<packed_mutexes>(threads, false, locks);
+        double m_shared = run<packed_mutexes>(threads, true, locks);
+        printf("%2d threads               %9.1f  %11.1f  %9.1f  %12.1f\n",
+            threads, s_own, s_shared, m_own, m_shared);
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+/**
+ * Times values going through a chain of stateless stages (map and filter)
+ * and through accum_s and collect. It's built twice: bench/pipeline uses the
+ * typed stages, and bench/pipeline-erased is built with SODIUM_NO_TYPED_STAGES
+ * so every hop goes through std::function.
+ *
+ * Run with
+ * bench/pipeline [values] [depth]
+ */
+#include <sodium/sodium.hpp>
+#include <chrono>
+#include <tuple>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace sodium;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    return d.count();
+}
+
+/*!
+ * Send 'values' values into s, each in its own transaction, and return the time
+ * taken per value in nanoseconds.
+ */
+static double time_sends(const stream_sink<int>& s, int values)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < values; i++)
+        s.send(i);
+    return seconds_since(start) * 1e9 / values;
+}
+
+int main(int argc, char* argv[])
+{
+    int values = argc >= 2 ? atoi(argv[1]) : 1000000;
+    int depth = argc >= 3 ? atoi(argv[2]) : 8;
+#if defined(SODIUM_NO_TYPED_STAGES)
+    printf("erased stages, %d values\n", values);
+#else
+    printf("typed stages, %d values\n", values);
+#endif
+    for (int round = 0; round < 3; round++) {
+        long total = 0;
+
+        stream_sink<int> s1;
+        stream<int> chain = s1;
+        for (int i = 0; i < depth; i++)
+            chain = chain.map([i] (const int& x) { return x + i; })
+                         .filter([] (const int& x) { return x >= 0; });
+        auto kill1 = chain.listen([&total] (const int& x) { total += x; });
+        double stages = time_sends(s1, values);
+        kill1();
+
+        stream_sink<int> s2;
+        stream<long> sums = s2.accum_s<long>(0, [] (const int& x, const long& sum) { return sum + x; });
+        stream<long> diffs = sums.collect<long>(0, [] (const long& sum, const long& last) {
+            return std::tuple<long, long>(sum - last, sum);
+        });
+        auto kill2 = diffs.listen([&total] (const long& x) { total += x; });
+        double stateful = time_sends(s2, values);
+        kill2();
+
+        printf("map+filter x %d: %.1f ns/value   accum_s+collect: %.1f ns/value\n",
+            depth, stages, stateful);
+        if (total == 0)
+            printf("(no values)\n");
+    }
+    return 0;
+}
@@ -8,17 +8,57 @@
 #include "test_sodium.hpp"
 #include <sodium/sodium.hpp>
 #include <sodium/router.hpp>
+#include <sodium/ingest.hpp>
+#include <sodium/graph.hpp>
 #include <boost/optional.hpp>
 
 #include <cppunit/ui/text/TestRunner.h>
+#include <new>
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
 #include <iostream>
+#include <thread>
 
 using namespace std;
 using namespace sodium;
 using namespace boost;
 
+namespace {
+    // Allocations made by the current thread, counted by the operator new below
+    thread_local long allocations = 0;
+}
+
+void* operator new(size_t size)
+{
+    allocations++;
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    allocations++;
+    return malloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    free(p);
+}
 
 void test_sodium::tearDown()
 {
@@ -614,6 +654,52 @@ void test_sodium::switch_s1()
     CPPUNIT_ASSERT_EQUAL(string("ABCdeFGhI"), *out);
 }
 
+void test_sodium::switch_rerank_queued()
+{
+    // Switch onto a deep cell in a transaction where values are already queued,
+    // so the switch outputs are re-ranked while they have entries pending.
+    stream_sink<int> sa;
+    stream_sink<int> sb;
+    cell<int> ca = sa.hold(0);
+    cell<int> deep = ca;
+    for (int i = 0; i < 20; i++)
+        deep = deep.lift(ca, [] (const int& d, const int&) { return d + 1; });
+    cell<int> cb = sb.hold(100);
+    cell_sink<cell<int>> selc(cb);
+    cell<int> oc = switch_c(selc);
+    cell_sink<stream<int>> sels(sb);
+    stream<int> os = switch_s(sels);
+    cell<string> probe = oc.lift(deep, [] (const int& o, const int& d) {
+        return fmtInt(o) + " " + fmtInt(d);
+    });
+    auto out = std::make_shared<vector<string>>();
+    auto unlisten1 = probe.listen([out] (const string& x) { out->push_back(x); });
+    auto unlisten2 = os.listen([out] (const int& x) { out->push_back("s" + fmtInt(x)); });
+#if defined(SODIUM_INSTRUMENT)
+    auto regens = std::make_shared<size_t>(0);
+    partition::default_partition()->set_stats_callback([regens] (const transaction_stats& st) {
+        *regens += st.regens;
+    });
+#endif
+    {
+        transaction trans;
+        sa.send(1);
+        sb.send(101);
+        selc.send(deep);
+        sels.send(deep.updates());
+        trans.close();
+    }
+#if defined(SODIUM_INSTRUMENT)
+    partition::default_partition()->set_stats_callback(std::function<void(const transaction_stats&)>());
+    CPPUNIT_ASSERT(*regens > 0);
+#endif
+    sa.send(2);
+    sb.send(102);
+    unlisten1();
+    unlisten2();
+    CPPUNIT_ASSERT(vector<string>({ "100 20", "s101", "21 21", "s22", "22 22" }) == *out);
+}
+
 // NOTE! Currently this leaks memory.
 void test_sodium::loop_cell()
 {
@@ -686,6 +772,78 @@ void test_sodium::accum1()
     CPPUNIT_ASSERT(vector<int>({ 105, 112, 113, 115, 118 }) == *out);
 }
 
+void test_sodium::typed_pipeline()
+{
+    stream_sink<int> ea;
+    auto out = std::make_shared<vector<string>>();
+    auto evens_out = std::make_shared<vector<int>>();
+    auto evaluated = std::make_shared<int>(0);
+    stream<int> evens = ea.map([] (const int& x) { return x * 3; })
+                          .filter([] (const int& x) { return x % 2 == 0; });
+    stream<int> sums = evens.accum_s_lazy<int>(
+        lazy<int>(std::function<int()>([evaluated] () { (*evaluated)++; return 10; })),
+        [] (const int& a, const int& s) { return a + s; });
+    stream<string> labels = sums.collect<int>(0, [] (const int& sum, const int& n) {
+        return tuple<string, int>(to_string(n) + ":" + to_string(sum), n + 1);
+    });
+    auto unlisten = labels.listen([out] (const string& x) { out->push_back(x); });
+    // A second listener to the stages gets a node of its own
+    auto unlisten2 = evens.listen([evens_out] (const int& x) { evens_out->push_back(x); });
+    ea.send(1);
+    ea.send(2);
+    ea.send(3);
+    ea.send(4);
+    unlisten();
+    unlisten2();
+    CPPUNIT_ASSERT(vector<string>({ string("0:16"), string("1:28") }) == *out);
+    CPPUNIT_ASSERT(vector<int>({ 6, 12 }) == *evens_out);
+    CPPUNIT_ASSERT_EQUAL(1, *evaluated);
+}
+
+static bool pos(const int& x) { return x > 0; }
+static int triple(const int& x) { return x * 3; }
+static int add(const int& a, const int& s) { return a + s; }
+static tuple<int, int> delta(const int& a, const int& last) { return tuple<int, int>(a - last, a); }
+
+void test_sodium::typed_pipeline_functions()
+{
+    // Plain functions rather than functors
+    stream_sink<int> ea;
+    auto out = std::make_shared<vector<int>>();
+    stream<int> sums = ea.filter(pos).map(triple).accum_s<int>(0, add);
+    auto unlisten = sums.collect<int>(0, delta).listen([out] (const int& x) { out->push_back(x); });
+    ea.send(1);
+    ea.send(-5);
+    ea.send(2);
+    unlisten();
+    CPPUNIT_ASSERT(vector<int>({ 3, 6 }) == *out);
+}
+
+void test_sodium::typed_pipeline_mutable()
+{
+    // Functors that keep state of their own
+    stream_sink<int> ea;
+    auto out = std::make_shared<vector<int>>();
+    int skip = 0, index = 0, calls = 0, last = 0;
+    stream<int> sums = ea.filter([skip] (const int&) mutable { return skip++ % 2 == 0; })
+                         .map([index] (const int& x) mutable { return x * 10 + index++; })
+                         .accum_s<int>(0, [calls] (const int& a, const int& s) mutable {
+                             return a + s + 100 * calls++;
+                         });
+    auto unlisten = sums.collect<int>(0, [last] (const int& a, const int& s) mutable {
+            int d = a - last;
+            last = a;
+            return tuple<int, int>(d, s);
+        }).listen([out] (const int& x) { out->push_back(x); });
+    ea.send(1);
+    ea.send(2);
+    ea.send(3);
+    ea.send(4);
+    ea.send(5);
+    unlisten();
+    CPPUNIT_ASSERT(vector<int>({ 10, 131, 252 }) == *out);
+}
+
 void test_sodium::split1()
 {
     stream_sink<string> ea;
@@ -943,6 +1101,429 @@ void test_sodium::cant_send_in_handler()
     }
 }
 
+void test_sodium::firings_cleared_after_throw()
+{
+    stream_sink<int> sa;
+    auto kill1 = sa.listen([] (const int& i) {
+        if (i == 5) throw std::runtime_error("five");
+    });
+    try {
+        sa.send(5);
+        CPPUNIT_FAIL("exception expected");
+    }
+    catch (const std::runtime_error&) {
+    }
+    // A new listener only gets an earlier firing in the same transaction, so this
+    // one mustn't get the 5 from the transaction that failed.
+    auto out = std::make_shared<vector<int>>();
+    auto kill2 = sa.listen([out] (const int& i) { out->push_back(i); });
+    sa.send(6);
+    kill1();
+    kill2();
+    CPPUNIT_ASSERT(vector<int>({ 6 }) == *out);
+}
+
+void test_sodium::pool_alloc1()
+{
+    // Blocks that are in use at the same time mustn't overlap, whether they're
+    // new or recycled, and including sizes too big for the pools.
+    struct block {
+        char* p;
+        size_t size;
+        char fill;
+    };
+    std::vector<block> live;
+    int n = 0;
+    for (int round = 0; round < 3; round++) {
+        for (size_t i = 0; i < 1000; i++, n++) {
+            block b;
+            b.size = (n * 7) % 300;
+            b.p = static_cast<char*>(impl::pool_alloc(b.size));
+            b.fill = (char)(n & 0x7f);
+            memset(b.p, b.fill, b.size);
+            live.push_back(b);
+        }
+        // Free every other one, so the next round reuses them.
+        std::vector<block> kept;
+        for (size_t i = 0; i < live.size(); i++)
+            if (i % 2 == 0)
+                impl::pool_free(live[i].p, live[i].size);
+            else
+                kept.push_back(live[i]);
+        live.swap(kept);
+    }
+    for (size_t i = 0; i < live.size(); i++) {
+        for (size_t j = 0; j < live[i].size; j++)
+            CPPUNIT_ASSERT_EQUAL((int)live[i].fill, (int)live[i].p[j]);
+        impl::pool_free(live[i].p, live[i].size);
+    }
+    auto sp = impl::new_shared<vector<int>>(3, 7);
+    CPPUNIT_ASSERT(vector<int>({ 7, 7, 7 }) == *sp);
+}
+
+namespace {
+    /*!
+     * A stream on a node that tests can send to directly, so it can fire more than
+     * once in a transaction.
+     */
+    struct raw_stream : stream<int> {
+        raw_stream(const impl::stream_& s) : stream<int>(s) {}
+    };
+}
+
+void test_sodium::late_listen_replay()
+{
+    std::tuple<impl::stream_, std::shared_ptr<impl::node> > p = impl::unsafe_new_stream();
+    raw_stream sa(std::get<0>(p));
+    auto out = std::make_shared<vector<int>>();
+    std::function<void()> kill;
+    {
+        transaction trans;
+        impl::send(std::get<1>(p), trans.impl(), light_ptr::create<int>(1));
+        impl::send(std::get<1>(p), trans.impl(), light_ptr::create<int>(2));
+        kill = sa.listen([out] (const int& x) { out->push_back(x); });
+        impl::send(std::get<1>(p), trans.impl(), light_ptr::create<int>(3));
+        trans.close();
+    }
+    kill();
+    // The replay gives the values from before the listen, newest first, and not
+    // the one sent after it, which comes through the link.
+    CPPUNIT_ASSERT(vector<int>({ 2, 1, 3 }) == *out);
+}
+
+void test_sodium::count_set_transitions()
+{
+    impl::count_set c;
+    c.inc_stream();
+    c.inc_node();
+    c.inc_strong();
+    CPPUNIT_ASSERT(c.dec_strong() == impl::count_set::none);
+    // No longer active: clean up, holding a strong reference to do it
+    CPPUNIT_ASSERT(c.dec_node() == impl::count_set::clean_up);
+    CPPUNIT_ASSERT_EQUAL(1u, c.strong_count());
+    CPPUNIT_ASSERT(c.dec_strong() == impl::count_set::none);
+    CPPUNIT_ASSERT(c.dec_stream() == impl::count_set::destroy);
+
+    // Overflowing a count moves them all to the heap
+    impl::count_set big;
+    unsigned n = (1u << SODIUM_STREAM_BITS) + 3;
+    big.inc_node();
+    for (unsigned i = 0; i < n; i++)
+        big.inc_stream();
+    CPPUNIT_ASSERT(big.is_large());
+    CPPUNIT_ASSERT_EQUAL(n, big.stream_count());
+    CPPUNIT_ASSERT_EQUAL(1u, big.node_count());
+    for (unsigned i = 0; i < n - 1; i++)
+        CPPUNIT_ASSERT(big.dec_stream() == impl::count_set::none);
+    CPPUNIT_ASSERT(big.dec_stream() == impl::count_set::clean_up);
+    CPPUNIT_ASSERT(big.dec_strong() == impl::count_set::none);
+    CPPUNIT_ASSERT(big.dec_node() == impl::count_set::destroy);
+}
+
+namespace {
+    struct string_width {
+        size_t operator () (const string& s) const { return s.size(); }
+    };
+    typedef impl::rank_queue<unsigned long long, int, string, string_width> test_rank_queue;
+
+    // Pop everything, giving "rank/id/value" for each entry in the order they came out
+    vector<string> drain(test_rank_queue& q)
+    {
+        vector<string> out;
+        while (!q.empty()) {
+            unsigned long long rank = q.top_rank();
+            int id;
+            string value = q.pop(id);
+            out.push_back(to_string(rank) + "/" + to_string(id) + "/" + value);
+        }
+        return out;
+    }
+}
+
+void test_sodium::rank_queue_fifo()
+{
+    test_rank_queue q;
+    q.push(5, 1, "a");
+    q.push(5, 2, "b");
+    q.push(5, 4, "d");
+    // An older id goes into its place rather than at the back
+    q.push(5, 3, "c");
+    CPPUNIT_ASSERT_EQUAL((size_t)4, q.size());
+    CPPUNIT_ASSERT_EQUAL((size_t)4, q.top_width());
+    int id;
+    CPPUNIT_ASSERT_EQUAL(string("a"), q.pop(id));
+    CPPUNIT_ASSERT_EQUAL(1, id);
+    // Pushing after a pop still appends to the same bucket
+    q.push(5, 5, "ee");
+    CPPUNIT_ASSERT_EQUAL((size_t)5, q.top_width());
+    CPPUNIT_ASSERT(vector<string>({ "5/2/b", "5/3/c", "5/4/d", "5/5/ee" }) == drain(q));
+    CPPUNIT_ASSERT(q.empty());
+}
+
+void test_sodium::rank_queue_ranks()
+{
+    test_rank_queue q;
+    unsigned long long big = 1ull << 40;
+    q.push(1000000, 1, "m");
+    q.push(3, 2, "x");
+    q.push(big, 3, "far");
+    q.push(3, 4, "yy");
+    q.push(70, 5, "s");
+    q.push(1000000, 6, "n");
+    CPPUNIT_ASSERT_EQUAL(3ull, q.top_rank());
+    CPPUNIT_ASSERT_EQUAL((size_t)3, q.top_width());
+    int id;
+    CPPUNIT_ASSERT_EQUAL(string("x"), q.pop(id));
+    CPPUNIT_ASSERT_EQUAL(string("yy"), q.pop(id));
+    CPPUNIT_ASSERT_EQUAL(70ull, q.top_rank());
+    // A rank below everything that's left, and one in a gap between two others
+    q.push(0, 7, "zero");
+    q.push(999999, 8, "gap");
+    CPPUNIT_ASSERT(vector<string>({
+        "0/7/zero", "70/5/s", "999999/8/gap", "1000000/1/m", "1000000/6/n",
+        to_string(big) + "/3/far" }) == drain(q));
+}
+
+void test_sodium::rank_queue_clear()
+{
+    test_rank_queue q;
+    for (int round = 0; round < 3; round++) {
+        long before = allocations;
+        q.push(9, 1, "a");
+        q.push(2, 2, "b");
+        q.push(9, 3, "c");
+        q.push(40, 4, "d");
+        int id;
+        q.pop(id);
+        q.clear();
+        CPPUNIT_ASSERT(q.empty());
+        CPPUNIT_ASSERT_EQUAL((size_t)0, q.size());
+        q.push(40, 5, "e");
+        q.push(9, 6, "f");
+        q.push(40, 7, "g");
+        CPPUNIT_ASSERT_EQUAL(9ull, q.top_rank());
+        CPPUNIT_ASSERT_EQUAL((size_t)1, q.top_width());
+        q.pop(id);
+        CPPUNIT_ASSERT_EQUAL(6, id);
+        CPPUNIT_ASSERT_EQUAL(40ull, q.top_rank());
+        CPPUNIT_ASSERT_EQUAL((size_t)2, q.top_width());
+        q.pop(id);
+        CPPUNIT_ASSERT_EQUAL(5, id);
+        q.pop(id);
+        CPPUNIT_ASSERT_EQUAL(7, id);
+        CPPUNIT_ASSERT(q.empty());
+        // Once warmed up, the buckets are reused without allocating
+        if (round > 0)
+            CPPUNIT_ASSERT_EQUAL(0L, allocations - before);
+    }
+}
+
+void test_sodium::stream_copy_threads()
+{
+#if !defined(SODIUM_SINGLE_THREADED)
+    stream_sink<int> s;
+    stream<int> m = s.map([] (const int& x) { return x + 1; });
+    std::vector<std::thread> ts;
+    for (int i = 0; i < 4; i++)
+        ts.push_back(std::thread([m] () {
+            for (int j = 0; j < 10000; j++) {
+                stream<int> a(m);
+                stream<int> b;
+                b = a;
+            }
+        }));
+    for (size_t i = 0; i < ts.size(); i++)
+        ts[i].join();
+    auto out = std::make_shared<vector<int>>();
+    auto unlisten = m.listen([out] (const int& x) { out->push_back(x); });
+    s.send(1);
+    unlisten();
+    CPPUNIT_ASSERT(vector<int>({ 2 }) == *out);
+#endif
+}
+
+void test_sodium::spin_lock_contention()
+{
+#if !defined(SODIUM_SINGLE_THREADED)
+    // Hold the lock long enough that waiters give up spinning and park
+    impl::spin_lock* l = &impl::lock_pool[0];
+    long total = 0;
+    std::vector<std::thread> ts;
+    for (int i = 0; i < 8; i++)
+        ts.push_back(std::thread([l, &total] () {
+            for (int j = 0; j < 2000; j++) {
+                l->lock();
+                long t = total;
+                if (j % 100 == 0)
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                total = t + 1;
+                l->unlock();
+            }
+        }));
+    for (size_t i = 0; i < ts.size(); i++)
+        ts[i].join();
+    CPPUNIT_ASSERT_EQUAL(8L * 2000L, total);
+#endif
+}
+
+void test_sodium::light_ptr_copy()
+{
+    light_ptr null;
+    light_ptr a(null);
+    CPPUNIT_ASSERT(a.value == nullptr);
+    a = light_ptr::create<string>("five");
+    light_ptr b(a);
+    CPPUNIT_ASSERT_EQUAL(string("five"), *b.cast_ptr<string>(NULL));
+    a = null;
+    CPPUNIT_ASSERT_EQUAL(string("five"), *b.cast_ptr<string>(NULL));
+    // Assigning from a value that only the old value keeps alive
+    light_ptr outer = light_ptr::create<light_ptr>(light_ptr::create<int>(7));
+    outer = *outer.cast_ptr<light_ptr>(NULL);
+    CPPUNIT_ASSERT_EQUAL(7, *outer.cast_ptr<int>(NULL));
+#if !defined(SODIUM_SINGLE_THREADED)
+    // Copies made and dropped on several threads at once
+    std::vector<std::thread> ts;
+    for (int i = 0; i < 4; i++)
+        ts.push_back(std::thread([b] () {
+            for (int j = 0; j < 10000; j++) {
+                light_ptr c(b);
+                light_ptr d;
+                d = c;
+            }
+        }));
+    for (size_t i = 0; i < ts.size(); i++)
+        ts[i].join();
+#endif
+    CPPUNIT_ASSERT_EQUAL(1, b.count->c.load());
+}
+
+namespace {
+    struct small_pair {
+        short a, b;
+    };
+}
+
+void test_sodium::light_ptr_inline()
+{
+    // Small trivially copyable values need no allocation
+    light_ptr i = light_ptr::create<int>(5);
+    light_ptr d = light_ptr::create<double>(1.5);
+    light_ptr p = light_ptr::create<small_pair>(small_pair { 3, 4 });
+    CPPUNIT_ASSERT(i.count == nullptr);
+    CPPUNIT_ASSERT(d.count == nullptr);
+    CPPUNIT_ASSERT(p.count == nullptr);
+    light_ptr i2(i);
+    light_ptr d2;
+    d2 = d;
+    light_ptr p2(std::move(p));
+    CPPUNIT_ASSERT_EQUAL(5, *i2.cast_ptr<int>(NULL));
+    CPPUNIT_ASSERT_EQUAL(1.5, *d2.cast_ptr<double>(NULL));
+    CPPUNIT_ASSERT_EQUAL((short)4, p2.cast_ptr<small_pair>(NULL)->b);
+    // Reassigning between inline and counted values
+    light_ptr s = light_ptr::create<string>("heap");
+    CPPUNIT_ASSERT(s.count != nullptr);
+    i2 = s;
+    CPPUNIT_ASSERT_EQUAL(string("heap"), *i2.cast_ptr<string>(NULL));
+    CPPUNIT_ASSERT_EQUAL(2, s.count->c.load());
+    i2 = i;
+    CPPUNIT_ASSERT_EQUAL(5, *i2.cast_ptr<int>(NULL));
+    CPPUNIT_ASSERT_EQUAL(1, s.count->c.load());
+}
+
+namespace {
+    struct counted_value {
+        counted_value(int n_) : n(n_) {}
+        counted_value(const counted_value& other) : n(other.n) {}
+        ~counted_value() { destroyed++; }
+        int n;
+        long padding[3];
+        static int destroyed;
+    };
+    int counted_value::destroyed = 0;
+}
+
+void test_sodium::light_ptr_one_allocation()
+{
+    long before = allocations;
+    light_ptr a = light_ptr::create<counted_value>(counted_value(7));
+    CPPUNIT_ASSERT_EQUAL(1L, allocations - before);
+    // The value sits in the same block as its count
+    CPPUNIT_ASSERT((void*)a.count < a.value);
+    CPPUNIT_ASSERT((char*)a.value < (char*)a.count + sizeof(impl::value_block<counted_value>));
+    string payload(100, 'x');
+    before = allocations;
+    light_ptr s = light_ptr::create<string>(std::move(payload));
+    CPPUNIT_ASSERT_EQUAL(1L, allocations - before);
+    before = allocations;
+    {
+        light_ptr b(a);
+        light_ptr c;
+        c = s;
+        c = b;
+        light_ptr i = light_ptr::create<int>(1);
+    }
+    CPPUNIT_ASSERT_EQUAL(0L, allocations - before);
+    int destroyed = counted_value::destroyed;
+    a = s;
+    CPPUNIT_ASSERT_EQUAL(destroyed + 1, counted_value::destroyed);
+    CPPUNIT_ASSERT_EQUAL((size_t)100, a.cast_ptr<string>(NULL)->size());
+}
+
+void test_sodium::fan_out_no_alloc()
+{
+    std::tuple<impl::stream_, std::shared_ptr<impl::node> > p = impl::unsafe_new_stream();
+    raw_stream sa(std::get<0>(p));
+    const int targets = 32;
+    auto total = std::make_shared<int>(0);
+    vector<std::function<void()>> kills;
+    for (int i = 0; i < targets; i++)
+        kills.push_back(sa.listen([total] (const int& x) { *total += x; }));
+    light_ptr one = light_ptr::create<int>(1);
+    for (int round = 0; round < 3; round++) {
+        transaction trans;
+        long before = allocations;
+        impl::send(std::get<1>(p), trans.impl(), one);
+        trans.close();
+        // Once warmed up, sending to all the targets and running them allocates nothing
+        if (round > 0)
+            CPPUNIT_ASSERT_EQUAL(0L, allocations - before);
+    }
+    for (auto it = kills.begin(); it != kills.end(); ++it)
+        (*it)();
+    CPPUNIT_ASSERT_EQUAL(3 * targets, *total);
+}
+
+void test_sodium::sink_send_no_alloc()
+{
+    sodium::partition p;
+    stream_sink<int> s;
+    auto total = std::make_shared<int>(0);
+    std::function<void()> kill;
+    {
+        transaction trans(&p);
+        s = stream_sink<int>();
+        kill = s.map([] (const int& x) { return x * 2; })
+                .listen([total] (const int& x) { *total += x; });
+        trans.close();
+    }
+    s.send(1);
+    impl::transaction_impl* spare = p.spare;
+    CPPUNIT_ASSERT(spare != NULL);
+    for (int i = 0; i < 3; i++) {
+        long before = allocations;
+        s.send(2);
+        // Each send reuses the same transaction context, and allocates nothing
+        CPPUNIT_ASSERT_EQUAL(0L, allocations - before);
+        CPPUNIT_ASSERT(p.spare == spare);
+    }
+    {
+        transaction trans(&p);
+        kill();
+        trans.close();
+    }
+    CPPUNIT_ASSERT_EQUAL(14, *total);
+}
+
 struct Packet {
     Packet(int address_, std::string payload_)
     : address(address_),
@@ -1086,6 +1667,541 @@ void test_sodium::router_loop1()
     CPPUNIT_ASSERT(vector<string>({ "manuka", "tawa", "rata" }) == *out_three);
 }
 
+void test_sodium::partitions1()
+{
+    sodium::partition p1, p2;
+    auto out = std::make_shared<vector<int>>();
+    stream_sink<int> s1;
+    std::function<void()> kill;
+    {
+        transaction trans(&p1);
+        s1 = stream_sink<int>();
+        kill = s1.map([] (const int& x) { return x * 10; })
+                 .listen([out] (const int& x) { out->push_back(x); });
+        trans.close();
+    }
+    {
+        // Holding p2's lock must not stop another thread sending into p1.
+        transaction trans(&p2);
+        std::thread t([s1] () { s1.send(5); s1.send(7); });
+        t.join();
+        trans.close();
+    }
+    {
+        transaction trans(&p1);
+        kill();
+        trans.close();
+    }
+    CPPUNIT_ASSERT(vector<int>({ 50, 70 }) == *out);
+}
+
+void test_sodium::cross1()
+{
+    sodium::partition p1, p2;
+    auto out = std::make_shared<vector<string>>();
+    stream_sink<string> s1;
+    stream<string> s2;
+    {
+        transaction trans(&p1);
+        s1 = stream_sink<string>();
+        s2 = cross(s1.map([] (const string& x) { return x + "!"; }), &p2);
+        trans.close();
+    }
+    std::function<void()> kill;
+    {
+        transaction trans(&p2);
+        kill = s2.listen([out] (const string& x) { out->push_back(x); });
+        trans.close();
+    }
+    s1.send("kea");
+    s1.send("tui");
+    {
+        transaction trans(&p2);
+        kill();
+        trans.close();
+    }
+    CPPUNIT_ASSERT(vector<string>({ "kea!", "tui!" }) == *out);
+}
+
+void test_sodium::cross2()
+{
+    // cross() called outside any transaction, on a stream in a non-default partition
+    sodium::partition p1, p2;
+    auto out = std::make_shared<vector<string>>();
+    stream_sink<string> s1;
+    stream<string> m;
+    {
+        transaction trans(&p1);
+        s1 = stream_sink<string>();
+        m = s1.map([] (const string& x) { return x + "!"; });
+        trans.close();
+    }
+    stream<string> s2 = cross(m, &p2);
+    std::function<void()> kill;
+    {
+        transaction trans(&p2);
+        kill = s2.listen([out] (const string& x) { out->push_back(x); });
+        trans.close();
+    }
+    s1.send("kea");
+    s1.send("tui");
+    {
+        transaction trans(&p2);
+        kill();
+        trans.close();
+    }
+    CPPUNIT_ASSERT(vector<string>({ "kea!", "tui!" }) == *out);
+}
+
+void test_sodium::partitions2()
+{
+    // Combinators used outside any transaction work in the stream's own partition,
+    // so they don't wait for another thread that holds the default partition.
+    sodium::partition p1;
+    stream_sink<int> s1;
+    {
+        transaction trans(&p1);
+        s1 = stream_sink<int>();
+        trans.close();
+    }
+#if !defined(SODIUM_SINGLE_THREADED)
+    std::atomic<bool> holding(false), release(false);
+    std::thread t([&holding, &release] () {
+        transaction trans;
+        holding = true;
+        while (!release)
+            std::this_thread::yield();
+        trans.close();
+    });
+    while (!holding)
+        std::this_thread::yield();
+#endif
+    auto out = std::make_shared<vector<int>>();
+    cell<int> c = s1.map([] (const int& x) { return x * 10; })
+                    .filter([] (const int& x) { return x != 20; })
+                    .hold(0);
+    std::function<void()> kill = c.listen([out] (const int& x) { out->push_back(x); });
+    s1.send(1);
+    s1.send(2);
+    s1.send(3);
+    kill();
+#if !defined(SODIUM_SINGLE_THREADED)
+    release = true;
+    t.join();
+#endif
+    CPPUNIT_ASSERT(vector<int>({ 0, 10, 30 }) == *out);
+}
+
+void test_sodium::ingest1()
+{
+    ingest_sink<int> s;
+    auto out = std::make_shared<vector<int>>();
+    auto kill = s.listen([out] (const int& x) { out->push_back(x); });
+    vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.push_back(std::thread([s, t] () {
+            for (int i = 0; i < 1000; i++)
+                s.send(t * 1000 + i);
+        }));
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+    kill();
+    CPPUNIT_ASSERT_EQUAL((size_t)4000, out->size());
+    // Each thread's values must arrive in the order it sent them.
+    vector<int> last(4, -1);
+    for (auto it = out->begin(); it != out->end(); ++it) {
+        int t = *it / 1000;
+        CPPUNIT_ASSERT(*it % 1000 == last[t] + 1);
+        last[t] = *it % 1000;
+    }
+}
+
+void test_sodium::ingest_group()
+{
+    ingest_sink<int> s([] (const int& a, const int& b) { return a + b; }, 8);
+    auto out = std::make_shared<vector<int>>();
+    auto kill = s.listen([out] (const int& x) { out->push_back(x); });
+    vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.push_back(std::thread([s] () {
+            for (int i = 0; i < 1000; i++)
+                s.send(1);
+        }));
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+    kill();
+    int total = 0;
+    for (auto it = out->begin(); it != out->end(); ++it) {
+        CPPUNIT_ASSERT(*it >= 1 && *it <= 8);
+        total += *it;
+    }
+    CPPUNIT_ASSERT_EQUAL(4000, total);
+}
+
+static vector<string> wide_graph(sodium::partition* part)
+{
+    auto out = std::make_shared<vector<string>>();
+    stream_sink<int> s;
+    vector<std::function<void()>> kills;
+    {
+        transaction trans(part);
+        s = stream_sink<int>([] (const int& a, const int& b) { return a + b; });
+        for (int i = 0; i < 40; i++) {
+            stream<int> si = s.map([i] (const int& x) { return x * i; })
+                              .filter([i] (const int& x) { return i % 3 != 0 || x > 100; })
+                              .map([] (const int& x) { return x + 1; });
+            kills.push_back(si.or_else(si.map([] (const int& x) { return -x; }))
+                              .listen([out, i] (const int& x) {
+                                  char buf[32];
+                                  sprintf(buf, "%d:%d", i, x);
+                                  out->push_back(buf);
+                              }));
+        }
+        trans.close();
+    }
+    s.send(3);
+    {
+        transaction trans(part);
+        s.send(4);
+        s.send(5);
+        trans.close();
+    }
+    for (auto it = kills.begin(); it != kills.end(); ++it)
+        (*it)();
+    return *out;
+}
+
+void test_sodium::parallel_levels()
+{
+    sodium::partition p1, p2;
+    p2.set_parallelism(4, 4);
+    vector<string> seq = wide_graph(&p1);
+    vector<string> par = wide_graph(&p2);
+    CPPUNIT_ASSERT_EQUAL((size_t)64, seq.size());
+    CPPUNIT_ASSERT(seq == par);
+}
+
+static vector<string> switching_graph(sodium::partition* part)
+{
+    auto out = std::make_shared<vector<string>>();
+    vector<std::function<void()>> kills;
+    std::shared_ptr<impl::node> n;
+    {
+        transaction trans(part);
+        std::tuple<impl::stream_, std::shared_ptr<impl::node> > p = impl::unsafe_new_stream(part);
+        raw_stream sa(std::get<0>(p));
+        n = std::get<1>(p);
+        // Each switch_s() output passes on every value sa fires in a transaction,
+        // so each gets more than one entry in a level.
+        for (int i = 0; i < 40; i++) {
+            stream<int> si = switch_s(cell<stream<int>>(sa));
+            kills.push_back(si.listen([out, i] (const int& x) {
+                out->push_back(to_string(i) + ":" + to_string(x));
+            }));
+        }
+        trans.close();
+    }
+    {
+        transaction trans(part);
+        impl::send(n, trans.impl(), light_ptr::create<int>(1));
+        impl::send(n, trans.impl(), light_ptr::create<int>(2));
+        trans.close();
+    }
+    for (auto it = kills.begin(); it != kills.end(); ++it)
+        (*it)();
+    return *out;
+}
+
+void test_sodium::parallel_levels_order()
+{
+    sodium::partition p1, p2;
+    p2.set_parallelism(4, 4);
+    vector<string> seq = switching_graph(&p1);
+    vector<string> par = switching_graph(&p2);
+    CPPUNIT_ASSERT_EQUAL((size_t)80, seq.size());
+    CPPUNIT_ASSERT(seq == par);
+}
+
+void test_sodium::unlisten_many()
+{
+    stream_sink<int> s;
+    auto out = std::make_shared<vector<int>>();
+    vector<std::function<void()>> kills;
+    for (int i = 0; i < 10000; i++)
+        kills.push_back(s.listen([out, i] (const int& x) { out->push_back(i); }));
+    // Unlisten all but every hundredth, in an order that isn't the listen order.
+    for (int i = 0; i < 10000; i += 2)
+        if (i % 100 != 0) kills[i]();
+    s.send(1);
+    for (int i = 9999; i > 0; i -= 2)
+        kills[i]();
+    s.send(2);
+    for (int i = 0; i < 10000; i += 100)
+        kills[i]();
+    s.send(3);
+    CPPUNIT_ASSERT_EQUAL((size_t)(5000 + 100 + 100), out->size());
+    // Newest listener first
+    CPPUNIT_ASSERT_EQUAL(9999, out->front());
+    CPPUNIT_ASSERT_EQUAL(9900, (*out)[5100]);
+    CPPUNIT_ASSERT_EQUAL(0, out->back());
+}
+
+void test_sodium::fused_stages()
+{
+    stream_sink<int> s;
+    auto calls = std::make_shared<int>(0);
+    stream<int> sa = s.map([calls] (const int& x) { (*calls)++; return x + 1; });
+    for (int i = 0; i < 9; i++)
+        sa = (i % 3 == 2 ? sa.filter([] (const int& x) { return x % 2 == 0; })
+                         : sa.map([] (const int& x) { return x * 2; }));
+    auto out1 = std::make_shared<vector<int>>();
+    auto out2 = std::make_shared<vector<int>>();
+    auto out3 = std::make_shared<vector<int>>();
+    auto kill1 = sa.listen([out1] (const int& x) { out1->push_back(x); });
+    s.send(1);
+    auto kill2 = sa.listen([out2] (const int& x) { out2->push_back(x); });
+    auto kill3 = sa.listen([out3] (const int& x) { out3->push_back(x); });
+    s.send(2);
+    kill1();
+    s.send(3);
+    kill2();
+    kill3();
+    s.send(4);
+    auto out4 = std::make_shared<vector<int>>();
+    auto kill4 = sa.listen([out4] (const int& x) { out4->push_back(x); });
+    s.send(5);
+    kill4();
+    CPPUNIT_ASSERT(vector<int>({ 128, 192 }) == *out1);
+    CPPUNIT_ASSERT(vector<int>({ 192, 256 }) == *out2);
+    CPPUNIT_ASSERT(vector<int>({ 192, 256 }) == *out3);
+    CPPUNIT_ASSERT(vector<int>({ 384 }) == *out4);
+    // Once per firing while anything is listening, however many listeners there are
+    CPPUNIT_ASSERT_EQUAL(4, *calls);
+}
+
+void test_sodium::fused_stages_in_transaction()
+{
+    stream_sink<int> s;
+    auto calls = std::make_shared<int>(0);
+    stream<int> sa = s.map([calls] (const int& x) { (*calls)++; return x * 10; });
+    auto out1 = std::make_shared<vector<int>>();
+    auto out2 = std::make_shared<vector<int>>();
+    auto kill1 = sa.listen([out1] (const int& x) { out1->push_back(x); });
+    std::function<void()> kill2;
+    {
+        // The first listener is moved onto the shared node in the middle of this
+        transaction trans;
+        s.send(1);
+        kill2 = sa.listen([out2] (const int& x) { out2->push_back(x); });
+        trans.close();
+    }
+    s.send(2);
+    kill1();
+    kill2();
+    CPPUNIT_ASSERT(vector<int>({ 10, 20 }) == *out1);
+    CPPUNIT_ASSERT(vector<int>({ 10, 20 }) == *out2);
+}
+
+void test_sodium::deep_stage_chain()
+{
+    // Long enough to overflow the stack if any of this recursed once per stage
+    const int depth = 100000;
+    stream_sink<int> s;
+    auto out = std::make_shared<vector<int>>();
+    {
+        stream<int> chain = s;
+        for (int i = 0; i < depth; i++)
+            chain = chain.map([] (const int& x) { return x + 1; });
+        s.send(0);
+        auto kill = chain.listen([out] (const int& x) { out->push_back(x); });
+        s.send(1);
+        kill();
+        s.send(2);
+    }
+    s.send(3);
+    CPPUNIT_ASSERT(vector<int>({ depth + 1 }) == *out);
+}
+
+static bool ranks_increase(const graph_info& g)
+{
+    for (size_t i = 0; i < g.edges.size(); i++)
+        if (g.nodes[g.edges[i].first].rank >= g.nodes[g.edges[i].second].rank)
+            return false;
+    return true;
+}
+
+void test_sodium::rank_gap_exhaustion()
+{
+    // Link a new node in between the last one and the head of a chain, over and
+    // over, so the gap below the head keeps halving until it runs out and the
+    // chain has to be moved up.
+    vector<std::shared_ptr<impl::node>> chain;
+    for (int i = 0; i < 8; i++) {
+        chain.push_back(std::make_shared<impl::node>());
+        if (i > 0)
+            chain[i - 1]->link(NULL, chain[i]);
+    }
+    impl::rank_t tail_rank = chain.back()->rank;
+    vector<std::shared_ptr<impl::node>> ups({ std::make_shared<impl::node>() });
+    for (int i = 0; i < 200; i++) {
+        std::shared_ptr<impl::node> m = std::make_shared<impl::node>();
+        m->link(NULL, chain.front());
+        ups.back()->link(NULL, m);
+        ups.push_back(m);
+        for (size_t j = 1; j < ups.size(); j++)
+            CPPUNIT_ASSERT(ups[j - 1]->rank < ups[j]->rank);
+        CPPUNIT_ASSERT(ups.back()->rank < chain.front()->rank);
+        for (size_t j = 1; j < chain.size(); j++)
+            CPPUNIT_ASSERT(chain[j - 1]->rank < chain[j]->rank);
+    }
+    CPPUNIT_ASSERT(chain.back()->rank > tail_rank);
+
+    // The same thing through switch_c, switching onto a deeper cell each time,
+    // while the chain below the switch keeps giving consistent values.
+    stream_sink<int> sa;
+    cell<int> ca = sa.hold(0);
+    cell_sink<cell<int>> sel(ca);
+    cell<int> oc = switch_c(sel);
+    cell<int> tail = oc;
+    for (int i = 0; i < 10; i++)
+        tail = tail.lift(ca, [] (const int& t, const int&) { return t + 1; });
+    cell<int> probe = tail.lift(oc, [] (const int& t, const int& o) { return t - o; });
+    auto out = std::make_shared<vector<int>>();
+    auto kill = probe.updates().listen([out] (const int& x) { out->push_back(x); });
+    cell<int> up = ca;
+    for (int i = 1; i <= 20; i++) {
+        up = up.lift(ca, [] (const int& u, const int&) { return u; });
+        {
+            transaction trans;
+            sel.send(up);
+            sa.send(i);
+            trans.close();
+        }
+        CPPUNIT_ASSERT_EQUAL(i + 10, tail.sample());
+    }
+    CPPUNIT_ASSERT(ranks_increase(graph_inspector().add(probe).inspect()));
+    kill();
+    CPPUNIT_ASSERT(vector<int>(20, 10) == *out);
+}
+
+void test_sodium::listen_during_send()
+{
+    stream_sink<int> s;
+    auto out = std::make_shared<vector<string>>();
+    auto kills = std::make_shared<vector<std::function<void()>>>();
+    kills->push_back(s.listen([out] (const int& x) { out->push_back("a" + std::to_string(x)); }));
+    kills->push_back(s.listen([s, out, kills] (const int& x) {
+        // Enough new targets to make s move its existing ones
+        if (x == 1)
+            for (int i = 0; i < 20; i++)
+                kills->push_back(s.listen([out, i] (const int& y) {
+                    if (i == 0) out->push_back("c" + std::to_string(y));
+                }));
+    }));
+    kills->push_back(s.listen([out] (const int& x) { out->push_back("b" + std::to_string(x)); }));
+    s.send(1);
+    s.send(2);
+    for (size_t i = 0; i < kills->size(); i++)
+        (*kills)[i]();
+    // A listener added during a send gets that value once, from the replay of s's
+    // firings, not from the send itself
+    CPPUNIT_ASSERT(vector<string>({ "b1", "a1", "c1", "c2", "b2", "a2" }) == *out);
+}
+
+static size_t count_listeners(const graph_info& g)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < g.nodes.size(); i++)
+        if (g.nodes[i].rank == SODIUM_IMPL_RANK_T_MAX)
+            n++;
+    return n;
+}
+
+void test_sodium::graph1()
+{
+    stream_sink<int> s;
+    stream<int> sa = s.map([] (const int& x) { return x + 1; }).filter([] (const int& x) { return x > 0; });
+    cell<int> c = sa.hold(0);
+    auto kill1 = sa.listen([] (const int&) {});
+    auto kill2 = s.listen([] (const int&) {});
+    graph_info g = graph_inspector().add(sa).add(c).inspect();
+    vector<size_t> fan_in(g.nodes.size());
+    for (size_t i = 0; i < g.edges.size(); i++)
+        fan_in[g.edges[i].second]++;
+    size_t roots = 0;
+    for (size_t i = 0; i < g.nodes.size(); i++) {
+        CPPUNIT_ASSERT_EQUAL(fan_in[i], g.nodes[i].fan_in);
+        if (g.nodes[i].root) roots++;
+    }
+    // sa and c's updates are both s with stages fused onto it
+    CPPUNIT_ASSERT_EQUAL((size_t)1, roots);
+    CPPUNIT_ASSERT_EQUAL((size_t)3, count_listeners(g));
+    CPPUNIT_ASSERT(g.to_dot().find("n0 -> n1;") != string::npos);
+    CPPUNIT_ASSERT(g.to_json().find("\"edges\":[[0,1],") != string::npos);
+    kill1();
+    kill2();
+    CPPUNIT_ASSERT_EQUAL((size_t)1, count_listeners(graph_inspector().add(sa).inspect()));
+}
+
+void test_sodium::graph_partition()
+{
+    // Inspect a graph in another partition while it's in use
+    sodium::partition p;
+    stream_sink<int> s;
+    std::function<void()> kill;
+    {
+        transaction trans(&p);
+        s = stream_sink<int>();
+        kill = s.map([] (const int& x) { return x + 1; }).listen([] (const int&) {});
+        trans.close();
+    }
+    std::thread sender([s] () {
+        for (int i = 0; i < 1000; i++)
+            s.send(i);
+    });
+    for (int i = 0; i < 100; i++) {
+        graph_info g = graph_inspector().add(s).inspect();
+        CPPUNIT_ASSERT_EQUAL((size_t)1, count_listeners(g));
+    }
+    sender.join();
+    {
+        transaction trans(&p);
+        kill();
+        trans.close();
+    }
+}
+
+#if defined(SODIUM_INSTRUMENT)
+void test_sodium::transaction_stats1()
+{
+    sodium::partition p;
+    auto stats = std::make_shared<vector<transaction_stats>>();
+    p.set_stats_callback([stats] (const transaction_stats& st) { stats->push_back(st); });
+    stream_sink<int> s;
+    std::function<void()> kill;
+    {
+        transaction trans(&p);
+        s = stream_sink<int>();
+        kill = s.map([] (const int& x) { return x + 1; })
+                .listen([] (const int&) {});
+        trans.close();
+    }
+    stats->clear();
+    s.send(1);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, stats->size());
+    const transaction_stats& st = stats->back();
+    CPPUNIT_ASSERT(st.prioritized >= 2);  // coalesce in the sink, listener with the map fused in
+    CPPUNIT_ASSERT(st.max_rank > 0);
+    CPPUNIT_ASSERT(st.fired_nodes >= 1);  // the sink's node
+    CPPUNIT_ASSERT(st.wall_ns >= 0 && st.lock_wait_ns >= 0);
+    {
+        transaction trans(&p);
+        kill();
+        trans.close();
+    }
+}
+#endif
+
 int main(int argc, char* argv[])
 {
     for (int i = 0; i < 1; i++) {
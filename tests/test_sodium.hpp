@@ -27,6 +27,9 @@ class test_sodium : public CppUnit::TestFixture {
     CPPUNIT_TEST(once1);
     CPPUNIT_TEST(collect1);
     CPPUNIT_TEST(accum1);
+    CPPUNIT_TEST(typed_pipeline);
+    CPPUNIT_TEST(typed_pipeline_functions);
+    CPPUNIT_TEST(typed_pipeline_mutable);
     // behaviour tests
     CPPUNIT_TEST(collect2);
     CPPUNIT_TEST(hold1);
@@ -52,6 +55,7 @@ class test_sodium : public CppUnit::TestFixture {
     CPPUNIT_TEST(hold_is_delayed);
     CPPUNIT_TEST(switch_c1);
     CPPUNIT_TEST(switch_s1);
+    CPPUNIT_TEST(switch_rerank_queued);
     CPPUNIT_TEST(loop_cell);
     CPPUNIT_TEST(split1);
     CPPUNIT_TEST(add_cleanup1);
@@ -69,9 +73,42 @@ class test_sodium : public CppUnit::TestFixture {
     CPPUNIT_TEST(lift_from_simultaneous);
     CPPUNIT_TEST(stream_sink_combining);
     CPPUNIT_TEST(cant_send_in_handler);
+    CPPUNIT_TEST(firings_cleared_after_throw);
+    CPPUNIT_TEST(pool_alloc1);
+    CPPUNIT_TEST(late_listen_replay);
+    CPPUNIT_TEST(count_set_transitions);
+    CPPUNIT_TEST(rank_queue_fifo);
+    CPPUNIT_TEST(rank_queue_ranks);
+    CPPUNIT_TEST(rank_queue_clear);
+    CPPUNIT_TEST(stream_copy_threads);
+    CPPUNIT_TEST(spin_lock_contention);
+    CPPUNIT_TEST(light_ptr_copy);
+    CPPUNIT_TEST(light_ptr_inline);
+    CPPUNIT_TEST(light_ptr_one_allocation);
+    CPPUNIT_TEST(fan_out_no_alloc);
+    CPPUNIT_TEST(sink_send_no_alloc);
     CPPUNIT_TEST(router1);
     CPPUNIT_TEST(router2);
     CPPUNIT_TEST(router_loop1);
+    CPPUNIT_TEST(partitions1);
+    CPPUNIT_TEST(cross1);
+    CPPUNIT_TEST(cross2);
+    CPPUNIT_TEST(partitions2);
+    CPPUNIT_TEST(ingest1);
+    CPPUNIT_TEST(ingest_group);
+    CPPUNIT_TEST(parallel_levels);
+    CPPUNIT_TEST(parallel_levels_order);
+    CPPUNIT_TEST(unlisten_many);
+    CPPUNIT_TEST(fused_stages);
+    CPPUNIT_TEST(fused_stages_in_transaction);
+    CPPUNIT_TEST(deep_stage_chain);
+    CPPUNIT_TEST(rank_gap_exhaustion);
+    CPPUNIT_TEST(listen_during_send);
+    CPPUNIT_TEST(graph1);
+    CPPUNIT_TEST(graph_partition);
+#if defined(SODIUM_INSTRUMENT)
+    CPPUNIT_TEST(transaction_stats1);
+#endif
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -90,6 +127,9 @@ public:
     void once1();
     void collect1();
     void accum1();
+    void typed_pipeline();
+    void typed_pipeline_functions();
+    void typed_pipeline_mutable();
     void collect2();
     void hold1();
     void snapshot1();
@@ -115,6 +155,7 @@ public:
     void hold_is_delayed();
     void switch_c1();
     void switch_s1();
+    void switch_rerank_queued();
     void loop_cell();
     void split1();
     void add_cleanup1();
@@ -132,9 +173,42 @@ public:
     void lift_from_simultaneous();
     void stream_sink_combining();
     void cant_send_in_handler();
+    void firings_cleared_after_throw();
+    void pool_alloc1();
+    void late_listen_replay();
+    void count_set_transitions();
+    void rank_queue_fifo();
+    void rank_queue_ranks();
+    void rank_queue_clear();
+    void stream_copy_threads();
+    void spin_lock_contention();
+    void light_ptr_copy();
+    void light_ptr_inline();
+    void light_ptr_one_allocation();
+    void fan_out_no_alloc();
+    void sink_send_no_alloc();
     void router1();
     void router2();
     void router_loop1();
+    void partitions1();
+    void cross1();
+    void cross2();
+    void partitions2();
+    void ingest1();
+    void ingest_group();
+    void parallel_levels();
+    void parallel_levels_order();
+    void unlisten_many();
+    void fused_stages();
+    void fused_stages_in_transaction();
+    void deep_stage_chain();
+    void rank_gap_exhaustion();
+    void listen_during_send();
+    void graph1();
+    void graph_partition();
+#if defined(SODIUM_INSTRUMENT)
+    void transaction_stats1();
+#endif
 };
 
 #endif